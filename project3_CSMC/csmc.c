@@ -5,6 +5,8 @@
 #include "time.h"
 #include "semaphore.h"
 #include "stdbool.h"
+#include "stdint.h"
+#include "errno.h"
 
 int nanosleep(const struct timespec *req, struct timespec *rem);
 
@@ -15,21 +17,18 @@ int empty_chairs = 0;
 int total_sessions = 0;
 int tutoring_now = 0;
 int total_requests = 0;
-int student_counter = 1;
 int tutor_counter = 1;
+int no_chair_count = 0; // times a student waited for a chair and none came
 
-pthread_mutex_t queue_lock;
 pthread_mutex_t dequeue_lock;
 pthread_mutex_t tutoring_now_lock;
 pthread_mutex_t total_sessions_lock;
-pthread_mutex_t stud_id_lock;
 pthread_mutex_t tut_id_lock;
 pthread_mutex_t empty_chairs_lock;
-pthread_mutex_t student_lock;
+
+pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;
 
 sem_t stud_sem;
-sem_t queue_sem;
-sem_t coord_sem;
 sem_t *session_sem;
 
 time_t t;
@@ -39,108 +38,200 @@ struct student
     int stud_id;
     int tut_id;
     int priority;
-    struct student *next;
+    struct student *next; // behind this student in its bucket or the waitlist
+    struct student *prev; // ahead of this student in the waitlist
+    sem_t chair_sem;      // posted when a freed chair is handed to this student
+    bool has_chair;
 };
 
-struct waiting_student
+// how long a student waits for a chair before walking away, 20 ms
+#define CHAIR_WAIT_NS 20000000L
+
+// the most help a student can ask for, so that every priority has a bit in
+// priority_words and every word a bit in priority_summary
+#define MAX_HELP (64 * 64 - 1)
+
+// the students waiting at one priority, first come first served
+struct bucket
 {
-    struct student *student;
-    struct waiting_student *next;
+    struct student *head;
+    struct student *tail;
 };
 
-struct student *all_studs_head;
-struct waiting_student *queue_head;
-int stud_to_queue;
-
-struct waiting_student *dequeue()
+// every student, indexed by stud_id from 1, as session_sem is
+struct student *students;
+struct bucket *queue_buckets;
+struct bucket chair_waitlist;
+uint64_t priority_words[64];
+uint64_t priority_summary;
+
+// students who have taken a chair and are not yet queued, newest first
+// students push themselves without a lock, and the coordinator takes them all
+// at once, so a student is never taken while another is being pushed
+struct student *arrivals;
+
+// take the student with the most help left, the first to arrive among equals
+// the caller holds dequeue_lock, and the queue must not be empty
+struct student *dequeue()
 {
-    struct waiting_student *traversingNode = queue_head;
-    struct waiting_student *dequeuedNode;
+    // find the highest priority with a student waiting
+    int word = 63 - __builtin_clzll(priority_summary);
+    int priority = word * 64 + 63 - __builtin_clzll(priority_words[word]);
+    struct bucket *bucket = &queue_buckets[priority];
+    struct student *dequeuedNode = bucket->head;
 
-    // if there is one student in the queue
-    if (!queue_head->next)
+    bucket->head = dequeuedNode->next;
+
+    // if that was the last student at this priority
+    if (!bucket->head)
     {
-        queue_head = NULL;
+        bucket->tail = NULL;
+        priority_words[word] &= ~(1ULL << (priority % 64));
+        if (!priority_words[word])
+        {
+            priority_summary &= ~(1ULL << word);
+        }
+    }
+
+    return dequeuedNode;
+}
+
+// add a student behind the others waiting at the same priority
+// the caller holds dequeue_lock
+void enqueue(struct student *stud_to_queue)
+{
+    int priority = stud_to_queue->priority;
+    struct bucket *bucket = &queue_buckets[priority];
 
-        return traversingNode;
+    stud_to_queue->next = NULL;
+
+    // if the bucket is not empty
+    if (bucket->tail)
+    {
+        bucket->tail->next = stud_to_queue;
     }
-    // if there are two students
-    else if (!queue_head->next->next)
+    // if the bucket is empty
+    else
     {
-        dequeuedNode = queue_head->next;
-        queue_head->next = NULL;
-
-        return dequeuedNode;
+        bucket->head = stud_to_queue;
+        priority_words[priority / 64] |= 1ULL << (priority % 64);
+        priority_summary |= 1ULL << (priority / 64);
     }
+    bucket->tail = stud_to_queue;
+}
 
-    // if there are more than two students
-    while (traversingNode->next->next)
+// wait in line for a chair, without using the CPU, until one is handed over
+// or the wait runs out; the caller holds empty_chairs_lock, and holds it
+// again on return
+// returns true if the student has a chair
+bool wait_for_chair(struct student *studentNode)
+{
+    struct timespec deadline;
+    int waited;
+
+    // join the back of the line
+    studentNode->next = NULL;
+    studentNode->prev = chair_waitlist.tail;
+    studentNode->has_chair = false;
+    if (chair_waitlist.tail)
     {
-        traversingNode = traversingNode->next;
+        chair_waitlist.tail->next = studentNode;
     }
+    else
+    {
+        chair_waitlist.head = studentNode;
+    }
+    chair_waitlist.tail = studentNode;
+    pthread_mutex_unlock(&empty_chairs_lock);
 
-    dequeuedNode = traversingNode->next;
-    traversingNode->next = NULL;
-
-    return dequeuedNode;
-}
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += CHAIR_WAIT_NS;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    do
+    {
+        waited = sem_timedwait(&studentNode->chair_sem, &deadline);
+    } while (waited != 0 && errno == EINTR);
 
-void enqueue(struct waiting_student *stud_to_queue)
-{
-    pthread_mutex_lock(&dequeue_lock);
-    struct waiting_student *traversingNode = queue_head;
-    struct waiting_student *previousNode = NULL;
-    bool notEmpty = queue_head != NULL;
+    pthread_mutex_lock(&empty_chairs_lock);
 
-    // if the queue is not empty
-    if (notEmpty)
+    // if a chair was handed over just as the wait ran out, take the post too
+    if (waited != 0 && studentNode->has_chair)
     {
-        // find the node to insert before
-        while (traversingNode)
+        sem_wait(&studentNode->chair_sem);
+    }
+    // if no chair came, leave the line from wherever the student is in it
+    else if (waited != 0)
+    {
+        if (studentNode->prev)
         {
-            if (traversingNode->student->priority < stud_to_queue->student->priority)
-            {
-                previousNode = traversingNode;
-                traversingNode = traversingNode->next;
-            }
-            else
-            {
-                break;
-            }
+            studentNode->prev->next = studentNode->next;
+        }
+        else
+        {
+            chair_waitlist.head = studentNode->next;
         }
-        // if previous node exists
-        if (previousNode)
+        if (studentNode->next)
         {
-            // insert between traversing node and previous node
-            stud_to_queue->next = traversingNode;
-            previousNode->next = stud_to_queue;
+            studentNode->next->prev = studentNode->prev;
         }
-        // if no previous node
         else
         {
-            // insert before head
-            stud_to_queue->next = queue_head;
-            queue_head = stud_to_queue;
+            chair_waitlist.tail = studentNode->prev;
         }
     }
-    // if the queue is empty
+
+    return studentNode->has_chair;
+}
+
+// give up a chair: the student waiting longest for one takes it, or it is
+// left empty; the caller holds empty_chairs_lock
+void free_chair()
+{
+    struct student *waitingNode = chair_waitlist.head;
+
+    // if nobody is waiting
+    if (!waitingNode)
+    {
+        empty_chairs++;
+        return;
+    }
+
+    chair_waitlist.head = waitingNode->next;
+    if (chair_waitlist.head)
+    {
+        chair_waitlist.head->prev = NULL;
+    }
     else
     {
-        queue_head = stud_to_queue;
-        queue_head->next = NULL;
+        chair_waitlist.tail = NULL;
     }
-    pthread_mutex_unlock(&dequeue_lock);
+    waitingNode->has_chair = true;
+    sem_post(&waitingNode->chair_sem);
+}
+
+// hand a student to the coordinator, without waiting for it
+void arrive(struct student *studentNode)
+{
+    struct student *head = __atomic_load_n(&arrivals, __ATOMIC_RELAXED);
+
+    do
+    {
+        studentNode->next = head;
+    } while (!__atomic_compare_exchange_n(&arrivals, &head, studentNode, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    // signal arrival to coordinator
+    sem_post(&stud_sem);
 }
 
 void *student_routine(void *arg)
 {
     struct student *studentNode = (struct student *)arg;
-    int studentId;
-    pthread_mutex_lock(&stud_id_lock);
-    studentNode->stud_id = student_counter;
-    student_counter++;
-    pthread_mutex_unlock(&stud_id_lock);
-    studentId = studentNode->stud_id;
+    int studentId = studentNode->stud_id;
 
     srand((unsigned)time(&t));
 
@@ -149,48 +240,47 @@ void *student_routine(void *arg)
         pthread_mutex_lock(&empty_chairs_lock);
         if (empty_chairs == 0)
         {
-            pthread_mutex_unlock(&empty_chairs_lock);
-            printf("St: Student %d found no empty chair. Will try again later.\n", studentId);
-            nanosleep((const struct timespec[]){{0, (rand() % 2000000L)}}, NULL);
-            continue;
+            // wait for a chair, and if none comes in time, come back later
+            if (!wait_for_chair(studentNode))
+            {
+                no_chair_count++;
+                printf("St: Student %d found no empty chair. Will try again later.\n", studentId);
+                pthread_mutex_unlock(&empty_chairs_lock);
+                nanosleep((const struct timespec[]){{0, (rand() % 2000000L)}}, NULL);
+                continue;
+            }
         }
         else
         {
             //  take chair
             empty_chairs--;
-            printf("St: Student %d takes a seat. Empty chairs = %d.\n",
-                   studentId, empty_chairs);
-            pthread_mutex_unlock(&empty_chairs_lock);
-
-            pthread_mutex_lock(&student_lock);
-
-            // set student as the next to be queued
-            pthread_mutex_lock(&queue_lock);
-            stud_to_queue = studentId;
-            pthread_mutex_unlock(&queue_lock);
-
-            // signal arrival to coordinator
-            sem_post(&stud_sem);
+        }
 
-            // wait for coordinator to signal queue placement
-            sem_wait(&queue_sem);
+        printf("St: Student %d takes a seat. Empty chairs = %d.\n",
+               studentId, empty_chairs);
+        pthread_mutex_unlock(&empty_chairs_lock);
 
-            pthread_mutex_unlock(&student_lock);
+        arrive(studentNode);
 
-            // wait for tutor
-            sem_wait(&session_sem[studentId]);
+        // wait for tutor
+        sem_wait(&session_sem[studentId]);
 
-            // simulate being tutored for 2 ms
-            nanosleep((const struct timespec[]){{0, 200000L}}, NULL);
-            printf("St: Student %d received help from Tutor %d.\n",
-                   studentId, studentNode->tut_id);
+        // simulate being tutored for 2 ms
+        nanosleep((const struct timespec[]){{0, 200000L}}, NULL);
+        printf("St: Student %d received help from Tutor %d.\n",
+               studentId, studentNode->tut_id);
 
-            // decrease priority
-            studentNode->priority--;
-        }
+        // decrease priority
+        studentNode->priority--;
     }
 }
 
+// unlock dequeue_lock if a tutor is cancelled while waiting on queue_ready
+static void unlock_dequeue(void *lock)
+{
+    pthread_mutex_unlock(lock);
+}
+
 void *tutor_routine()
 {
     struct student *studentToTutor;
@@ -202,13 +292,15 @@ void *tutor_routine()
 
     while (1)
     {
-        // wait for coordinator
-        sem_wait(&coord_sem);
-
-        // get the next student
+        // wait for coordinator to queue a student, then take the next one
         pthread_mutex_lock(&dequeue_lock);
-        studentToTutor = dequeue()->student;
-        pthread_mutex_unlock(&dequeue_lock);
+        pthread_cleanup_push(unlock_dequeue, &dequeue_lock);
+        while (!priority_summary)
+        {
+            pthread_cond_wait(&queue_ready, &dequeue_lock);
+        }
+        studentToTutor = dequeue();
+        pthread_cleanup_pop(1);
 
         // set the tutor for the student
         studentToTutor->tut_id = tutorId;
@@ -236,53 +328,68 @@ void *tutor_routine()
 
 void *coordinator_routine()
 {
-    int nextStudentId;
-    struct student *nextStudent;
-    struct waiting_student *nextWaiting;
-    struct student *traversingNode;
+    struct student *batch;
+    struct student **batchOrder = malloc(STUDENTS * sizeof(struct student *));
+    int *batchPriority = malloc(STUDENTS * sizeof(int));
+    int batchSize;
+    int i;
 
     while (1)
     {
         // wait for student to signal arrival
         sem_wait(&stud_sem);
 
-        // increment total help requests received
-        total_requests++;
-
-        // get next student
-        pthread_mutex_lock(&queue_lock);
-        nextStudentId = stud_to_queue;
-        pthread_mutex_unlock(&queue_lock);
-
-        // signal to student they have been queued
-        sem_post(&queue_sem);
-
-        traversingNode = all_studs_head;
+        // take every student who has arrived since the last batch, newest
+        // first; a student is in at most one batch until tutored, so the
+        // batch fits in batchOrder
+        batch = __atomic_exchange_n(&arrivals, NULL, __ATOMIC_ACQUIRE);
+        batchSize = 0;
+        while (batch)
+        {
+            batchOrder[batchSize++] = batch;
+            batch = batch->next;
+        }
 
-        // find next student
-        while (traversingNode != NULL)
+        // queue the whole batch at once, in the order the students arrived,
+        // then wake the tutors once; a student's priority only drops once
+        // tutored, so it is read before the student can be dequeued
+        pthread_mutex_lock(&dequeue_lock);
+        for (i = batchSize - 1; i >= 0; i--)
         {
-            if (traversingNode->stud_id == nextStudentId)
-            {
-                break;
-            }
-            traversingNode = traversingNode->next;
+            batchPriority[i] = batchOrder[i]->priority;
+            enqueue(batchOrder[i]);
         }
-        nextStudent = traversingNode;
 
-        nextWaiting = malloc(sizeof(struct waiting_student *));
-        nextWaiting->student = nextStudent;
+        // signal tutors
+        if (batchSize == 1)
+        {
+            pthread_cond_signal(&queue_ready);
+        }
+        else
+        {
+            pthread_cond_broadcast(&queue_ready);
+        }
+        pthread_mutex_unlock(&dequeue_lock);
 
-        enqueue(nextWaiting);
+        for (i = batchSize - 1; i >= 0; i--)
+        {
+            // increment total help requests received
+            total_requests++;
 
-        pthread_mutex_lock(&empty_chairs_lock);
-        printf("Co: Student %d with priority %d in the queue. Waiting students now = %d. Total requests = %d.\n",
-               nextStudentId, nextStudent->priority, CHAIRS - empty_chairs - 1, total_requests);
-        empty_chairs++;
-        pthread_mutex_unlock(&empty_chairs_lock);
+            pthread_mutex_lock(&empty_chairs_lock);
+            printf("Co: Student %d with priority %d in the queue. Waiting students now = %d. Total requests = %d.\n",
+                   batchOrder[i]->stud_id, batchPriority[i], CHAIRS - empty_chairs - 1, total_requests);
+            free_chair();
+            pthread_mutex_unlock(&empty_chairs_lock);
+        }
 
-        // signal tutor
-        sem_post(&coord_sem);
+        // each student taken posted stud_sem once, so one wait per student
+        // after the first keeps the count; a student taken may not have
+        // posted yet, so the tutors are woken before waiting for it
+        for (i = 1; i < batchSize; i++)
+        {
+            sem_wait(&stud_sem);
+        }
     }
 }
 
@@ -295,11 +402,17 @@ int main(int argc, char *argv[])
     CHAIRS = atoi(argv[3]);
     HELP = atoi(argv[4]);
 
+    if (HELP > MAX_HELP)
+    {
+        printf("Help must be at most %d.\n", MAX_HELP);
+        return 1;
+    }
+
     empty_chairs = CHAIRS;
 
+    queue_buckets = calloc(HELP + 1, sizeof(struct bucket));
+
     sem_init(&stud_sem, 0, 0);
-    sem_init(&queue_sem, 0, 0);
-    sem_init(&coord_sem, 0, 0);
 
     pthread_t *student_threads;
     pthread_t *tutor_threads;
@@ -308,24 +421,19 @@ int main(int argc, char *argv[])
     student_threads = malloc(STUDENTS * sizeof(pthread_t));
     tutor_threads = malloc(TUTORS * sizeof(pthread_t));
 
-    session_sem = (sem_t *)malloc(STUDENTS * sizeof(sem_t));
-    struct student *student_to_add;
+    // ids start at 1, so slot 0 of each is unused
+    session_sem = (sem_t *)malloc((STUDENTS + 1) * sizeof(sem_t));
+    students = calloc(STUDENTS + 1, sizeof(struct student));
 
-    for (i = 0; i < STUDENTS; i++)
+    for (i = 1; i <= STUDENTS; i++)
     {
-        sem_init(&session_sem[i + 1], 0, 0);
-
-        // add student to list of students
-        student_to_add = malloc(sizeof(struct student));
-        student_to_add->priority = HELP;
+        sem_init(&session_sem[i], 0, 0);
 
-        pthread_create(&student_threads[i], NULL, student_routine, (void *)student_to_add);
+        students[i].stud_id = i;
+        students[i].priority = HELP;
+        sem_init(&students[i].chair_sem, 0, 0);
 
-        if (all_studs_head != NULL)
-        {
-            student_to_add->next = all_studs_head;
-        }
-        all_studs_head = student_to_add;
+        pthread_create(&student_threads[i - 1], NULL, student_routine, (void *)&students[i]);
     }
 
     for (i = 0; i < TUTORS; i++)
@@ -346,4 +454,7 @@ int main(int argc, char *argv[])
     }
 
     pthread_cancel(coordinator_thread);
+
+    // every student has been joined, so the count is final
+    printf("Students found no empty chair %d times.\n", no_chair_count);
 }
\ No newline at end of file
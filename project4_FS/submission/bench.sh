@@ -0,0 +1,83 @@
+#!/bin/bash
+
+# build fcheck and genfs, make sure every fault genfs can inject is found,
+# then time fcheck on generated images of growing size
+# usage: ./bench.sh [inodes...]
+# FILE_BLOCKS sets the data blocks per file, RUNS the runs kept the best of
+
+cd "$(dirname "$0")" || exit 1
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+
+gcc -O2 -pthread -o "$dir/fcheck" fcheck.c libfcheck.c geometry/*.c || exit 1
+gcc -O2 -o "$dir/genfs" genfs.c || exit 1
+
+sizes=${*:-10000 65536 1000000 4000000}
+file_blocks=${FILE_BLOCKS:-2}
+runs=${RUNS:-3}
+threads=$(nproc)
+[ "$threads" -gt 64 ] && threads=64
+failed=0
+
+check_fault()
+{
+    local fault=$1 expected=$2 args=$3
+    "$dir/genfs" $args --fault "$fault" "$dir/fault" || { failed=1; return; }
+    local found=$("$dir/fcheck" "$dir/fault" 2>&1)
+    if [ "$found" = "ERROR: $expected" ]; then
+        echo "ok      $fault"
+    else
+        echo "FAILED  $fault: $found"
+        failed=1
+    fi
+}
+
+echo 'faults'
+check_fault badinode 'bad inode.'
+check_fault badaddr 'bad direct address in inode.'
+check_fault badindir1 'bad indirect address in inode.'
+check_fault badindir2 'bad indirect address in inode.'
+check_fault badroot 'root directory does not exist.'
+check_fault badroot2 'root directory does not exist.'
+check_fault badfmt 'directory not properly formatted.'
+check_fault mrkfree 'address used by inode but marked free in bitmap.'
+check_fault indirfree 'address used by inode but marked free in bitmap.'
+check_fault mrkused 'bitmap marks block in use but it is not in use.'
+check_fault addronce 'direct address used more than once.'
+check_fault addronce2 'indirect address used more than once.'
+check_fault imrkused 'inode marked use but not found in a directory.'
+check_fault imrkfree 'inode referred to in directory but marked free.'
+check_fault badrefcnt 'bad reference count for file.'
+check_fault badrefcnt2 'bad reference count for file.'
+check_fault dironce 'directory appears more than once in file system.'
+check_fault badlarge 'directory appears more than once in file system.' '-i 1000 -f 400'
+
+# best wall time of several runs, in seconds
+best_time()
+{
+    local best= i start end
+    for ((i = 0; i < runs; i++)); do
+        start=$(date +%s%N)
+        "$@" > /dev/null 2>&1
+        end=$(date +%s%N)
+        [ -z "$best" ] || [ $((end - start)) -lt "$best" ] && best=$((end - start))
+    done
+    awk -v ns="$best" 'BEGIN { printf "%.4f", ns / 1e9 }'
+}
+
+echo
+printf '%10s %8s %10s %10s %14s %10s\n' inodes threads MB seconds inodes/s MB/s
+for inodes in $sizes; do
+    "$dir/genfs" -i "$inodes" -z "$file_blocks" "$dir/image" || exit 1
+    "$dir/fcheck" "$dir/image" || { echo "generated image failed the check"; exit 1; }
+    mb=$(awk -v bytes="$(stat -c %s "$dir/image")" 'BEGIN { printf "%.1f", bytes / 1e6 }')
+
+    for j in $(echo 1 "$threads" | tr ' ' '\n' | sort -un); do
+        seconds=$(best_time "$dir/fcheck" -j "$j" "$dir/image")
+        awk -v n="$inodes" -v j="$j" -v mb="$mb" -v s="$seconds" \
+            'BEGIN { printf "%10d %8d %10.1f %10.4f %14.0f %10.1f\n", n, j, mb, s, n / s, mb / s }'
+    done
+    rm -f "$dir/image"
+done
+
+exit $failed
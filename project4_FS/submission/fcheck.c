@@ -1,470 +1,756 @@
 #include <stdio.h>
-#include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
-#include <fcntl.h>
+#include <ctype.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <glob.h>
+#include <unistd.h>
 #include <sys/stat.h>
-#include <sys/mman.h>
-#include "fs.h"
+#include "libfcheck.h"
 
 #define EXIT_SUCCESS 0
 #define EXIT_FAILURE 1
-uint dirsize = sizeof(struct dirent);
-#define DIRSIZE dirsize
 
 #define PERROR(msg...) fprintf(stderr, msg)
 
-int fsfd;
-int inode_blocks;
-int datablocks_start;
-int datablocks_end;
-int bitmap_start;
+// the images checked in batch mode, in input order
+struct batch
+{
+    char **paths;
+    struct fcheck_options options;
+    struct fcheck_result *results;
+    int *done;
+    int count;
+    int next;
+    pthread_mutex_t lock;
+    pthread_cond_t checked;
+};
+
+char *report_path;
+char *trace_path;
+
+// the --lookup and --whohas queries, in the order given
+struct query
+{
+    char kind;
+    char *argument;
+};
+
+// helper for write_report
+// write a string with the characters JSON needs escaped
+// names in an image are raw bytes, so control characters and bytes that
+// are not ASCII are written as \u00XX, each byte as the code point it is
+// in Latin-1, which keeps the report valid JSON whatever the image holds
+void write_json_string(FILE *report, const char *string)
+{
+    const unsigned char *next = (const unsigned char *)string;
+
+    fputc('"', report);
+    for (; *next; next++)
+    {
+        if (*next == '"' || *next == '\\')
+        {
+            fputc('\\', report);
+            fputc(*next, report);
+        }
+        else if (*next < 0x20 || *next >= 0x7f)
+        {
+            fprintf(report, "\\u%04x", *next);
+        }
+        else
+        {
+            fputc(*next, report);
+        }
+    }
+    fputc('"', report);
+}
 
-char *mem_map_image;
-int *bitmap_references;
-int *indirect_pointers;
-int *reference_count;
-int *directory_reference_count;
-int *inodes_allocated;
+// helper for main
+// write every error found in an image as a JSON object
+void write_report(const char *path, struct fcheck_result *result, FILE *report)
+{
+    fprintf(report, "{\n  \"image\": ");
+    write_json_string(report, path);
+    if (result->problem != NULL)
+    {
+        fprintf(report, ",\n  \"problem\": ");
+        write_json_string(report, result->problem);
+    }
+    fprintf(report, ",\n  \"error_count\": %d,\n  \"errors\": [", result->error_count);
+
+    int i;
+    for (i = 0; i < result->error_count; i++)
+    {
+        struct fcheck_error *record = &result->errors[i];
+
+        fprintf(report, "%s\n    { \"class\": \"%s\", \"message\": \"%s\"",
+                i ? "," : "", fcheck_name(record->error), fcheck_message(record->error));
+
+        if (record->inode != FCHECK_NONE)
+        {
+            fprintf(report, ", \"inode\": %ld", record->inode);
+        }
+        if (record->block != FCHECK_NONE)
+        {
+            fprintf(report, ", \"block\": %ld", record->block);
+        }
+        if (record->path != NULL)
+        {
+            fprintf(report, ", \"path\": ");
+            write_json_string(report, record->path);
+        }
+        if (record->repaired)
+        {
+            fprintf(report, ", \"repaired\": true");
+        }
+        fprintf(report, " }");
+    }
 
-struct superblock superblock;
-struct stat file_stat;
+    fprintf(report, "%s]\n}", result->error_count ? "\n  " : "");
+}
 
-// helps get a requested inode
-void get_inode(int inode_number, struct dinode *inode)
+// helper for main
+// print how long each phase took and what it did
+void write_stats(struct fcheck_result *result, FILE *out)
 {
-    struct dinode *temp;
-    char buf[BSIZE];
-    int bn = (inode_number / IPB) + 2;
+    int i;
 
-    lseek(fsfd, bn * BSIZE, 0);
-    read(fsfd, buf, BSIZE);
+    fprintf(out, "%-18s %10s %10s %12s %9s %10s %9s %10s\n", "phase", "seconds", "blocks",
+            "bytes", "syscalls", "directory", "indirect", "data");
+
+    for (i = 0; i < FCHECK_PHASES; i++)
+    {
+        struct fcheck_stats *stats = &result->phases[i];
+        fprintf(out, "%-18s %10.6f %10ld %12ld %9ld %10ld %9ld %10ld\n", fcheck_phase_name(i),
+                stats->seconds, stats->blocks_read, stats->bytes_touched, stats->syscalls,
+                stats->directory_blocks, stats->indirect_blocks, stats->data_blocks);
+    }
+}
 
-    temp = ((struct dinode *)buf) + (inode_number % IPB);
-    *inode = *temp;
+// helper for write_trace
+// write one complete event of a Chrome trace
+void write_event(FILE *trace, const char *name, int thread, struct fcheck_stats *stats)
+{
+    fprintf(trace, "    { \"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+            "\"ts\": %.3f, \"dur\": %.3f, \"args\": { \"blocks_read\": %ld, "
+            "\"bytes_touched\": %ld, \"syscalls\": %ld, \"directory_blocks\": %ld, "
+            "\"indirect_blocks\": %ld, \"data_blocks\": %ld } }",
+            name, thread, stats->start * 1e6, stats->seconds * 1e6, stats->blocks_read,
+            stats->bytes_touched, stats->syscalls, stats->directory_blocks,
+            stats->indirect_blocks, stats->data_blocks);
 }
 
-// helper for check_directory
-// make sure the given inode exists and update its number of references
-void check_type(int inode_number, char *name)
+// helper for main
+// write the phases, and the threads of check_inodes, as a timeline that
+// chrome://tracing and Perfetto can open
+void write_trace(struct fcheck_result *result)
 {
-    struct dinode inode;
-    get_inode(inode_number, &inode);
+    FILE *trace = fopen(trace_path, "w");
+    const char *separator = "\n";
+    char name[32];
+    int i;
 
-    if (inode.type <= 0)
+    if (trace == NULL)
     {
-        PERROR("ERROR: inode referred to in directory but marked free.\n");
+        PERROR("trace could not be written.\n");
         exit(EXIT_FAILURE);
     }
-    else 
+
+    fprintf(trace, "{ \"traceEvents\": [");
+    for (i = 0; i < FCHECK_PHASES; i++)
     {
-        if (inode.type == T_FILE)
+        if (result->phases[i].seconds > 0)
         {
-            reference_count[inode_number]--;
-        }
-        else if (inode.type == T_DIR)
-        {   
-            if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0) 
-            {
-                directory_reference_count[inode_number]--;
-            }
+            fprintf(trace, "%s", separator);
+            write_event(trace, fcheck_phase_name(i), 0, &result->phases[i]);
+            separator = ",\n";
         }
     }
+    for (i = 0; i < result->worker_count; i++)
+    {
+        snprintf(name, sizeof(name), "check_inodes worker %d", i);
+        fprintf(trace, "%s", separator);
+        write_event(trace, name, i + 1, &result->workers[i]);
+    }
+    fprintf(trace, "\n] }\n");
+
+    fclose(trace);
 }
 
-// helper for check_direct_pointers and check_indirect_pointers
-// make sure the given block's bit is set correctly
-void check_block(int block)
+// helper for main
+// open the file the report goes to
+FILE *open_report()
 {
-    char buf[BSIZE];
-    int addr = bitmap_start + (block / (BSIZE * 8));
-
-    lseek(fsfd, addr * BSIZE, 0);
-    read(fsfd, buf, BSIZE);
+    FILE *report = stdout;
 
-    if ((buf[block / 8] & MASK[block % 8]) == 0)
+    if (report_path != NULL && (report = fopen(report_path, "w")) == NULL)
     {
-        PERROR("ERROR: address used by inode but marked free in bitmap.\n");
+        PERROR("report could not be written.\n");
         exit(EXIT_FAILURE);
     }
+
+    return report;
 }
 
-// helper for check_direct_pointers and check_indirect_pointers
-// make sure the given directory is properly formatted
-void check_directory(int inode_number, int addr, int root_directory)
+// helper for batch_main
+// entry point of a batch mode thread
+// images are taken in input order until none are left
+void *batch_worker(void *arg)
 {
-    // read the data block for the directory into buffer
-    char buf[BSIZE];
-    lseek(fsfd, addr * BSIZE, 0);
-    read(fsfd, buf, BSIZE);
+    struct batch *batch = (struct batch *)arg;
 
-    if (root_directory == 1)
+    while (1)
     {
-        struct dirent *current_dir = (struct dirent *)buf;
-        struct dirent *parent_dir = (struct dirent *)(buf + sizeof(struct dirent));
+        int i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED);
+        if (i >= batch->count)
+        {
+            return NULL;
+        }
+
+        fcheck_path(batch->paths[i], &batch->options, &batch->results[i]);
 
-        ushort current_dir_inum = current_dir->inum;
-        ushort parent_dir_inum = parent_dir->inum;
+        pthread_mutex_lock(&batch->lock);
+        batch->done[i] = 1;
+        pthread_cond_broadcast(&batch->checked);
+        pthread_mutex_unlock(&batch->lock);
+    }
+}
 
-        // Checking for root directory
-        if (inode_number == 1)
-        {   
-            if (current_dir_inum != 1 || parent_dir_inum != 1)
+// helper for batch_main
+// get the images named in a list file, one per line, or the regular files
+// in a directory in name order
+char **read_batch(const char *source, int *count)
+{
+    char **paths = NULL;
+    int capacity = 0;
+    struct stat source_stat;
+
+    *count = 0;
+    if (stat(source, &source_stat) < 0)
+    {
+        PERROR("batch not found.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (S_ISDIR(source_stat.st_mode))
+    {
+        // glob sorts the names and leaves out hidden files
+        glob_t found;
+        char *pattern = malloc(strlen(source) + 3);
+        sprintf(pattern, "%s/*", source);
+
+        size_t i;
+        if (glob(pattern, 0, NULL, &found) == 0)
+        {
+            paths = malloc(found.gl_pathc * sizeof(char *));
+            for (i = 0; i < found.gl_pathc; i++)
             {
-                PERROR("ERROR: root directory does not exist.\n");
-                exit(EXIT_FAILURE);
+                struct stat entry_stat;
+                if (stat(found.gl_pathv[i], &entry_stat) == 0 && S_ISREG(entry_stat.st_mode))
+                {
+                    paths[(*count)++] = strdup(found.gl_pathv[i]);
+                }
             }
+            globfree(&found);
         }
-        // Checking that current directory refers to itself
-        else if (inode_number != current_dir_inum)
+        free(pattern);
+        return paths;
+    }
+
+    FILE *list = fopen(source, "r");
+    if (list == NULL)
+    {
+        PERROR("batch not found.\n");
+        exit(EXIT_FAILURE);
+    }
+
+    char *line = NULL;
+    size_t length = 0;
+    while (getline(&line, &length, list) >= 0)
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0')
         {
-            PERROR("ERROR: directory not properly formatted.\n");
-            exit(EXIT_FAILURE);
+            continue;
         }
 
-        check_type(current_dir_inum, current_dir->name);
-        if (current_dir_inum != 0)
+        if (*count == capacity)
         {
-            inodes_allocated[current_dir_inum]--;
+            capacity = capacity ? capacity * 2 : 64;
+            paths = realloc(paths, capacity * sizeof(char *));
         }
+        paths[(*count)++] = strdup(line);
+    }
+
+    fclose(list);
+    free(line);
+
+    return paths;
+}
 
-        check_type(parent_dir_inum, parent_dir->name);
-        if (parent_dir_inum != 0)
+// helper for main
+// check every image in a batch on a pool of threads and print the results
+// in input order as soon as they are known
+int batch_main(struct fcheck_options *options, const char *source)
+{
+    struct batch batch;
+    int i, status = EXIT_SUCCESS;
+
+    batch.paths = read_batch(source, &batch.count);
+    batch.options = *options;
+    batch.options.threads = 1;
+    batch.options.paths |= options->collect_all;
+    batch.results = calloc(batch.count, sizeof(struct fcheck_result));
+    batch.done = calloc(batch.count, sizeof(int));
+    batch.next = 0;
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.checked, NULL);
+
+    int count = options->threads < batch.count ? options->threads : batch.count;
+    pthread_t *pool = malloc(count * sizeof(pthread_t));
+    for (i = 0; i < count; i++)
+    {
+        if (pthread_create(&pool[i], NULL, batch_worker, &batch) != 0)
         {
-            inodes_allocated[parent_dir_inum]--;
+            PERROR("thread could not be created.\n");
+            exit(EXIT_FAILURE);
         }
     }
 
-    int start = 0;
-    // Updating the inodes used
-    if (root_directory)
+    // with --all the reports form a JSON array, otherwise one line per image
+    FILE *report = options->collect_all ? open_report() : NULL;
+    if (report != NULL)
     {
-        start = 2;
+        fprintf(report, "[");
     }
 
-    int max_directories = BSIZE / DIRSIZE;
-    struct dirent *entry;
+    // with --stats the phases of every image are added up
+    struct fcheck_result total = { NULL };
 
-    int dir;
-    for (dir = start; dir < max_directories; dir++)
+    for (i = 0; i < batch.count; i++)
     {
-        entry = (struct dirent *)((dir * DIRSIZE) + buf);
+        const char *path = batch.paths[i];
+        struct fcheck_result *result = &batch.results[i];
 
-        switch (entry->inum) {
-            case 0: 
-                continue;
-            default: 
-                check_type(entry->inum, entry->name);
-                inodes_allocated[entry->inum]--;
+        pthread_mutex_lock(&batch.lock);
+        while (!batch.done[i])
+        {
+            pthread_cond_wait(&batch.checked, &batch.lock);
         }
-    }
-}
+        pthread_mutex_unlock(&batch.lock);
 
-// helper for check_inodes
-// check the given inode's direct pointers
-void check_direct_pointers(struct dinode inode, int inode_number)
-{
-    int i, block_addr, root_directory;
-
-    for (i = 0; i < NDIRECT; i++)
-    {   
-        block_addr = inode.addrs[i];
+        if (result->problem != NULL || result->error_count > 0)
+        {
+            status = EXIT_FAILURE;
+        }
 
-        if (block_addr == 0)
+        if (report != NULL)
         {
-            continue;
+            fprintf(report, "%s\n", i ? "," : "");
+            write_report(path, result, report);
         }
-        else if (block_addr < datablocks_start || block_addr > datablocks_end)
+        else if (result->problem != NULL)
         {
-            PERROR("ERROR: bad direct address in inode.\n");
-            exit(EXIT_FAILURE);
+            printf("%s: %s\n", path, result->problem);
+        }
+        else if (result->error_count > 0 && options->paths && result->errors[0].path != NULL)
+        {
+            printf("%s: ERROR: %s (%s)\n", path, fcheck_message(result->errors[0].error),
+                   result->errors[0].path);
+        }
+        else if (result->error_count > 0)
+        {
+            printf("%s: ERROR: %s\n", path, fcheck_message(result->errors[0].error));
         }
         else
         {
-            // make sure block is marked used in bitmap
-            check_block(block_addr);
-
-            // update number of bitmap references
-            bitmap_references[block_addr - datablocks_start]--;
-
-            // if a directory, make sure it is properly formatted
-            if (inode.type == T_DIR)
-            {
-                switch (i)
-                {
-                    case 0: 
-                        root_directory = 1;
-                        break;
-                    default: 
-                        root_directory = 0;
-                }
-                check_directory(inode_number, block_addr, root_directory);
-            }
+            printf("%s: ok\n", path);
         }
-    }
-}
+        fflush(stdout);
 
-// helper for check_inodes
-// check the given inode's indirect pointers
-void check_indirect_pointers(struct dinode inode, int inode_number)
-{
-    int indirect = inode.addrs[NDIRECT];
-    int block_number;
+        int phase;
+        for (phase = 0; phase < FCHECK_PHASES; phase++)
+        {
+            struct fcheck_stats *stats = &result->phases[phase];
+            total.phases[phase].seconds += stats->seconds;
+            total.phases[phase].blocks_read += stats->blocks_read;
+            total.phases[phase].bytes_touched += stats->bytes_touched;
+            total.phases[phase].syscalls += stats->syscalls;
+            total.phases[phase].directory_blocks += stats->directory_blocks;
+            total.phases[phase].indirect_blocks += stats->indirect_blocks;
+            total.phases[phase].data_blocks += stats->data_blocks;
+        }
 
-    if (indirect == 0) {
-        // do nothing
+        fcheck_free_result(result);
+        free(batch.paths[i]);
     }
-    else if (indirect < datablocks_start || indirect > datablocks_end)
+
+    if (report != NULL)
     {
-        PERROR("ERROR: bad indirect address in inode.\n");
-        exit(EXIT_FAILURE);
+        fprintf(report, "\n]\n");
+        if (report != stdout)
+        {
+            fclose(report);
+        }
     }
-    else
+
+    for (i = 0; i < count; i++)
     {
-        check_block(indirect);
+        pthread_join(pool[i], NULL);
+    }
 
-        block_number = indirect - datablocks_start;
+    if (options->stats)
+    {
+        write_stats(&total, stderr);
+    }
 
-        indirect_pointers[block_number]++;
+    free(pool);
+    free(batch.paths);
+    free(batch.results);
+    free(batch.done);
 
-        bitmap_references[block_number]--;
+    return status;
+}
 
-        char buf[BSIZE];
+// helper for answer_queries
+// print one name an inode has
+void print_name(const char *path, void *arg)
+{
+    printf("%ld: %s\n", *(long *)arg, path);
+}
 
-        lseek(fsfd, indirect * BSIZE, 0);
-        read(fsfd, buf, BSIZE);
+// answer each query from the index the check kept
+// returns EXIT_FAILURE if a path leads nowhere or an inode has no names
+int answer_queries(struct fcheck_result *result, struct query *queries, int count)
+{
+    int status = EXIT_SUCCESS;
+    int i;
 
-        int i, block_addr;
-        for (i = 0; i < 128; i++)
+    for (i = 0; i < count; i++)
+    {
+        if (queries[i].kind == 'l')
         {
-            block_addr = *((int *)(buf + (i * 4)));
-            block_number = block_addr - datablocks_start;
-            if (block_addr != 0)
+            long inode = fcheck_lookup(result->index, queries[i].argument);
+            if (inode == FCHECK_NONE)
             {
-                if (block_addr < datablocks_start || block_addr > datablocks_end)
-                {
-                    PERROR("ERROR: bad indirect address in inode.\n");
-                    exit(EXIT_FAILURE);
-                }
-                else
-                {
-                    check_block(block_addr);
-
-                    indirect_pointers[block_number]++;
-
-                    bitmap_references[block_number]--;
-
-                    if (inode.type == T_DIR)
-                    {
-                        check_directory(inode_number, block_addr, 0);
-                    }
-                }
+                printf("%s: not found\n", queries[i].argument);
+                status = EXIT_FAILURE;
+            }
+            else
+            {
+                printf("%s: %ld\n", queries[i].argument, inode);
+            }
+        }
+        else
+        {
+            long inode = atol(queries[i].argument);
+            if (fcheck_whohas(result->index, inode, print_name, &inode) <= 0)
+            {
+                printf("%ld: no names\n", inode);
+                status = EXIT_FAILURE;
             }
         }
     }
+
+    return status;
 }
 
 // helper for main
-// get the details of the bitmap
-void get_bitmap_info()
+// a size such as 64M, or 0 if it is not one
+size_t parse_size(const char *text)
 {
-    char buf[BSIZE];
-
-    lseek(fsfd, bitmap_start * BSIZE, 0);
-    read(fsfd, buf, BSIZE);
+    const char *units = "KMG";
+    char *end;
+    unsigned long long size = strtoull(text, &end, 10);
+    char *unit = *end != '\0' ? strchr(units, toupper((unsigned char)*end)) : NULL;
 
-    int i;
-    int j = 0;
-    for (i = datablocks_start; i < datablocks_end; i++, j++)
+    if (unit != NULL)
     {
-        bitmap_references[j] = ((buf[i / 8] & MASK[i % 8]) != 0);
+        size <<= 10 * (unit - units + 1);
+        end++;
     }
+
+    return *end == '\0' && end != text ? (size_t)size : 0;
 }
 
 // helper for main
-// get the details of each inode
-void get_inodes_info()
+// print one difference fcheck_diff found, and count it
+void print_change(const char *change, void *arg)
 {
-    struct dinode inode;
+    printf("%s\n", change);
+    (*(long *)arg)++;
+}
 
-    int i;
-    for (i = 1; i < superblock.ninodes; i++)
+void usage()
+{
+    PERROR("Usage: xcheck [-j threads] [--all] [--report file] [--ordered] [--quick] [--paths]\n"
+           "              [--stats] [--trace file] [--lookup path] [--whohas inode]\n"
+           "              [--repair] [--mem size] [--prefetch depth] [--block-size bytes]\n"
+           "              [--double-indirect] [--cache file] <file_system_image|->\n"
+           "       xcheck --undo <undo_log> <file_system_image>\n"
+           "       xcheck [-j threads] [--block-size bytes] [--double-indirect]\n"
+           "              --diff <old_image> <new_image>\n"
+           "       xcheck [-j threads] [--all] [--report file] [--ordered] [--quick] [--paths]\n"
+           "              [--stats] [--mem size] [--prefetch depth] [--block-size bytes]\n"
+           "              [--double-indirect] --batch <list|directory>\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    struct fcheck_options check = { .threads = 1 };
+    struct fcheck_result result;
+    char *batch_source = NULL;
+    char *undo_log = NULL;
+    char *old_image = NULL;
+    struct query *queries = malloc(argc * sizeof(struct query));
+    int query_count = 0;
+
+    if (queries == NULL)
     {
-        get_inode(i, &inode);
+        PERROR("out of memory.\n");
+        exit(EXIT_FAILURE);
+    }
 
-        switch(inode.type) {
-            case T_FILE:
-                reference_count[i] = inode.nlink;
-                inodes_allocated[i] = 1;
+    struct option options[] = {
+        { "all", no_argument, NULL, 'a' },
+        { "report", required_argument, NULL, 'r' },
+        { "ordered", no_argument, NULL, 'o' },
+        { "batch", required_argument, NULL, 'b' },
+        { "stats", no_argument, NULL, 's' },
+        { "trace", required_argument, NULL, 't' },
+        { "quick", no_argument, NULL, 'q' },
+        { "paths", no_argument, NULL, 'p' },
+        { "lookup", required_argument, NULL, 'l' },
+        { "whohas", required_argument, NULL, 'w' },
+        { "repair", no_argument, NULL, 'R' },
+        { "undo", required_argument, NULL, 'u' },
+        { "mem", required_argument, NULL, 'm' },
+        { "prefetch", required_argument, NULL, 'P' },
+        { "block-size", required_argument, NULL, 'B' },
+        { "double-indirect", no_argument, NULL, 'D' },
+        { "cache", required_argument, NULL, 'C' },
+        { "diff", required_argument, NULL, 'd' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int option;
+    while ((option = getopt_long(argc, argv, "j:", options, NULL)) != -1)
+    {
+        switch (option)
+        {
+            case 'j':
+                check.threads = atoi(optarg);
                 break;
-            case T_DIR:
-                directory_reference_count[i] = 1;
-                inodes_allocated[i] = 1;
+            case 'a':
+                check.collect_all = 1;
                 break;
-            case T_DEV:
-                inodes_allocated[i] = 1;
-            default:
+            case 'r':
+                report_path = optarg;
+                break;
+            case 'o':
+                check.ordered = 1;
+                break;
+            case 'b':
+                batch_source = optarg;
+                break;
+            case 's':
+                check.stats = 1;
+                break;
+            case 'p':
+                check.paths = 1;
+                break;
+            case 'q':
+                check.quick = 1;
+                break;
+            case 't':
+                trace_path = optarg;
+                check.stats = 1;
+                break;
+            case 'R':
+                check.repair = 1;
                 break;
+            case 'u':
+                undo_log = optarg;
+                break;
+            case 'P':
+                check.prefetch = atoi(optarg);
+                break;
+            case 'B':
+                check.block_size = atoi(optarg);
+                break;
+            case 'D':
+                check.double_indirect = 1;
+                break;
+            case 'C':
+                check.cache = optarg;
+                break;
+            case 'd':
+                old_image = optarg;
+                break;
+            case 'm':
+                if ((check.memory = parse_size(optarg)) == 0)
+                {
+                    usage();
+                }
+                break;
+            case 'l':
+            case 'w':
+                queries[query_count++] = (struct query){ option, optarg };
+                check.index = 1;
+                break;
+            default:
+                usage();
         }
     }
-}
 
-// helper for main
-// make sure inodes are correct
-void check_inodes()
-{
-    struct dinode inode;
+    // the phases of different images do not share a timeline, and queries
+    // and caches are about a single image; a repair writes to the image, so
+    // it cannot come from stdin
+    if ((batch_source == NULL && optind >= argc) || check.threads < 1 ||
+        check.threads > FCHECK_MAX_THREADS ||
+        (batch_source != NULL &&
+         (trace_path != NULL || query_count > 0 || check.repair || check.cache != NULL)) ||
+        (undo_log != NULL && (batch_source != NULL || check.repair)) ||
+        (check.repair && optind < argc && strcmp(argv[optind], "-") == 0) ||
+        (old_image != NULL && (batch_source != NULL || undo_log != NULL || check.repair ||
+                               query_count > 0)))
+    {
+        usage();
+    }
 
-    int i;
-    for (i = 1; i < superblock.ninodes; i++)
+    // print what changed from one image to another, one change per line
+    // the exit status is 1 if anything did, as with diff
+    if (old_image != NULL)
     {
-        get_inode(i, &inode);
+        long changes = 0;
+        const char *problem = fcheck_diff(old_image, argv[optind], &check, print_change, &changes);
+        if (problem != NULL)
+        {
+            PERROR("%s\n", problem);
+            exit(EXIT_FAILURE);
+        }
+        exit(changes > 0 ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
 
-        if (inode.type < 0 || inode.type > 3)
+    // put an image back as it was before a repair
+    if (undo_log != NULL)
+    {
+        const char *problem = fcheck_undo(argv[optind], undo_log);
+        if (problem != NULL)
         {
-            PERROR("ERROR: bad inode.\n");
+            PERROR("%s\n", problem);
             exit(EXIT_FAILURE);
         }
-        else if (i == 1) // should be root directory
+        exit(EXIT_SUCCESS);
+    }
+
+    // in batch mode -j sizes the pool, and each image is checked on one thread
+    if (batch_source != NULL)
+    {
+        exit(batch_main(&check, batch_source));
+    }
+
+    // reports name where each bad inode is
+    int print_paths = check.paths;
+    check.paths |= check.collect_all;
+
+    // the bytes a repair replaces are kept next to the image
+    if (check.repair)
+    {
+        char *log = malloc(strlen(argv[optind]) + sizeof(".undo"));
+        if (log == NULL)
         {
-            if (inode.type != T_DIR)
-            {
-                PERROR("ERROR: root directory does not exist.\n");
-                exit(EXIT_FAILURE);
-            }
+            PERROR("out of memory.\n");
+            exit(EXIT_FAILURE);
         }
+        sprintf(log, "%s.undo", argv[optind]);
+        check.undo_log = log;
+    }
 
-        check_direct_pointers(inode, i);
+    // - reads the image from stdin, which is copied first if it is a pipe
+    int status = strcmp(argv[optind], "-") == 0 ? fcheck_fd(STDIN_FILENO, &check, &result)
+                                                : fcheck_path(argv[optind], &check, &result);
 
-        check_indirect_pointers(inode, i);
+    if (trace_path != NULL)
+    {
+        write_trace(&result);
     }
-}
 
-// helper for main
-// make sure blocks are only used once
-void check_addresses(int i)
-{
-    if (indirect_pointers[i] > 0)
+    if (result.problem != NULL)
     {
-        PERROR("ERROR: indirect address used more than once.\n");
+        PERROR("%s\n", result.problem);
         exit(EXIT_FAILURE);
     }
-    else
+
+    // report the first error, as the checker always has
+    if (result.error_count > 0 && print_paths && result.errors[0].path != NULL)
     {
-        PERROR("ERROR: direct address used more than once.\n");
-        exit(EXIT_FAILURE);
+        PERROR("ERROR: %s (%s)\n", fcheck_message(result.errors[0].error), result.errors[0].path);
+    }
+    else if (result.error_count > 0)
+    {
+        PERROR("ERROR: %s\n", fcheck_message(result.errors[0].error));
     }
-}
 
-// helper for main
-// make sure bitmap is correct
-void check_bitmap()
-{
-    int i;
-    for (i = 0; i < superblock.nblocks; i++)
+    if (check.collect_all)
     {
-        if (bitmap_references[i] == 1)
+        FILE *report = open_report();
+        write_report(argv[optind], &result, report);
+        fprintf(report, "\n");
+        if (report != stdout)
         {
-            PERROR("ERROR: bitmap marks block in use but it is not in use.\n");
-            exit(EXIT_FAILURE);
-        }
-        else if (bitmap_references[i] < 0)
-        {
-            check_addresses(i);
+            fclose(report);
         }
     }
-}
 
-// helper for main
-// make sure all inodes are referred to in some directory
-void check_directories()
-{
+    // say what was fixed, then check again for what is left
+    int repaired = 0;
     int i;
-    for (i = 0; i < superblock.ninodes; i++)
+    for (i = 0; i < result.error_count; i++)
     {
-        if (directory_reference_count[i] < 0)
-        {
-            PERROR("ERROR: directory appears more than once in file system.\n");
-            exit(EXIT_FAILURE);
-        }
-        else if (inodes_allocated[i] == 1)
+        repaired += result.errors[i].repaired;
+    }
+    if (check.repair && result.error_count > 0)
+    {
+        PERROR("repaired %d of %d errors%s%s\n", repaired, result.error_count,
+               repaired ? ", undo log in " : ".", repaired ? check.undo_log : "");
+    }
+    if (repaired > 0)
+    {
+        struct fcheck_options recheck = { .threads = check.threads, .block_size = check.block_size,
+                                          .double_indirect = check.double_indirect,
+                                          .cache = check.cache };
+        struct fcheck_result after;
+
+        status = fcheck_path(argv[optind], &recheck, &after);
+        if (after.problem != NULL)
         {
-            PERROR("ERROR: inode marked use but not found in a directory.\n");
-            exit(EXIT_FAILURE);
+            PERROR("%s\n", after.problem);
         }
-        else if (reference_count[i] >= 1 || reference_count[i] < 0)
+        else if (after.error_count > 0)
         {
-            PERROR("ERROR: bad reference count for file.\n");
-            exit(EXIT_FAILURE);
+            PERROR("ERROR: %s (after repair)\n", fcheck_message(after.errors[0].error));
         }
+        fcheck_free_result(&after);
     }
-}
-
-// helper for main
-// set global variables and allocate memory
-void init()
-{
-    // get file stat
-    if (fstat(fsfd, &file_stat) < 0)
-    {
-        exit(EXIT_FAILURE);
-    }
-
-    // Map memory
-    char *mem_map_image = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fsfd, 0);
 
-    superblock = *((struct superblock *)(mem_map_image + BSIZE));
-
-    directory_reference_count = malloc(sizeof(int) * superblock.ninodes);
-    reference_count = malloc(sizeof(int) * superblock.ninodes);
-    indirect_pointers = malloc(sizeof(int) * superblock.nblocks);
-    bitmap_references = malloc(sizeof(int) * superblock.nblocks);
-    inodes_allocated = malloc(sizeof(int) * superblock.ninodes);
-
-    // First bitmap block number
-    bitmap_start = 3 + (superblock.ninodes / (BSIZE / sizeof(struct dinode)));
-    // First data block number
-    datablocks_start = bitmap_start + (superblock.nblocks / (BSIZE * 8)) + 1;
-    // Last data block number
-    datablocks_end = datablocks_start + superblock.nblocks;
-}
-
-// helper for main
-// close file and free memory
-void cleanup()
-{
-    close(fsfd);
-    free(bitmap_references);
-    free(indirect_pointers);
-    free(inodes_allocated);
-    free(reference_count);
-    free(directory_reference_count);
-}
-
-int main(int argc, char *argv[])
-{
-    if (argc < 2)
+    // the index holds whatever names the walk could read, errors or not
+    if (query_count > 0 && answer_queries(&result, queries, query_count) != EXIT_SUCCESS)
     {
-        PERROR("Usage: xcheck <file_system_image>\n");
-        exit(EXIT_FAILURE);
+        status = EXIT_FAILURE;
     }
 
-    // open file system image for reading
-    if ((fsfd = open(argv[1], O_RDONLY)) < 0)
+    // after the first error, so scripts reading it are not affected
+    if (check.stats)
     {
-        PERROR("image not found.\n");
-        exit(EXIT_FAILURE);
+        write_stats(&result, stderr);
     }
 
-    init();
+    fcheck_free_result(&result);
+    free(queries);
+    free((char *)check.undo_log);
 
-    get_inodes_info();
-    get_bitmap_info();
-    check_inodes();
-    check_bitmap();
-    check_directories();
-
-    cleanup();
-
-    exit(EXIT_SUCCESS);
-}
\ No newline at end of file
+    exit(status);
+}
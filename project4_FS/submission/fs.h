@@ -9,7 +9,16 @@
 // Inodes start at block 2.
 
 #define ROOTINO 1  // root i-number
+
+// The block size, and whether inodes give up a direct pointer for a
+// double-indirect one, can be set when compiling, as in -DBSIZE=4096
+// -DDOUBLE_INDIRECT=1; the defaults are xv6's.
+#ifndef BSIZE
 #define BSIZE 512  // block size
+#endif
+#ifndef DOUBLE_INDIRECT
+#define DOUBLE_INDIRECT 0
+#endif
 
 /* The following code is added by Garrett Strealy, GJS160430. */ 
 
@@ -17,8 +26,6 @@
 #define T_FILE 2
 #define T_DEV 3
 
-static char MASK[] = { 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80 };
-
 /* End of code added */
 
 // File system super block
@@ -28,9 +35,10 @@ struct superblock {
   uint ninodes;      // Number of inodes.
 };
 
-#define NDIRECT 12
+#define NDIRECT (12 - DOUBLE_INDIRECT)
 #define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define NDINDIRECT (DOUBLE_INDIRECT * NINDIRECT * NINDIRECT)
+#define MAXFILE (NDIRECT + NINDIRECT + NDINDIRECT)
 
 // On-disk inode structure
 struct dinode {
@@ -39,7 +47,7 @@ struct dinode {
   short minor;          // Minor device number (T_DEV only)
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
-  uint addrs[NDIRECT+1];   // Data block addresses
+  uint addrs[NDIRECT+1+DOUBLE_INDIRECT];   // Data block addresses
 };
 
 // Inodes per block.
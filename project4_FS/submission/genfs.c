@@ -0,0 +1,474 @@
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "fs.h"
+
+// genfs: write a synthetic file system image in the fs.h format
+// the image is laid out as mkfs would lay it out, and is valid unless a
+// fault is injected, so fcheck can be measured on images of any size
+
+#define EXIT_SUCCESS 0
+#define EXIT_FAILURE 1
+
+#define PERROR(msg...) fprintf(stderr, msg)
+
+#define ENTRIES (BSIZE / sizeof(struct dirent))
+
+// the faults that can be injected, named as in test_images/README
+const char *faults[] = {
+    "badinode", "badaddr", "badindir1", "badindir2", "badroot", "badroot2",
+    "badfmt", "mrkfree", "indirfree", "mrkused", "addronce", "addronce2",
+    "imrkused", "imrkfree", "badrefcnt", "badrefcnt2", "dironce", "badlarge",
+    NULL
+};
+
+// user arguments
+int ninodes = 200;
+int fanout = 25;
+int file_blocks = 1;
+int spare_blocks = 16;
+const char *fault;
+
+// the image being written
+// a dirent holds inode numbers below 65536, so in larger inode tables only
+// the first allocated inodes are used and the rest are left free
+char *image;
+int allocated, size, nblocks, bitmap_start, datablocks_start, directories;
+int next_block;
+
+void die(const char *msg)
+{
+    PERROR("%s\n", msg);
+    exit(EXIT_FAILURE);
+}
+
+char *get_block(int block)
+{
+    return image + (long)block * BSIZE;
+}
+
+struct dinode *get_inode(int inode_number)
+{
+    return (struct dinode *)get_block(IBLOCK(inode_number)) + inode_number % IPB;
+}
+
+void set_bit(int block, int used)
+{
+    char *byte = get_block(bitmap_start) + block / 8;
+
+    if (used)
+    {
+        *byte |= 1 << (block % 8);
+    }
+    else
+    {
+        *byte &= ~(1 << (block % 8));
+    }
+}
+
+// helper for layout
+// directories are inodes 1 to directories, and every other inode is a file
+// the children of directory j are the inodes after 1 + (j - 1) * fanout
+int first_child(int directory)
+{
+    return 2 + (directory - 1) * fanout;
+}
+
+int children(int directory)
+{
+    int first = first_child(directory);
+    int last = first + fanout - 1;
+
+    if (first >= allocated)
+    {
+        return 0;
+    }
+
+    return (last < allocated ? last : allocated - 1) - first + 1;
+}
+
+int parent(int inode_number)
+{
+    return inode_number == ROOTINO ? ROOTINO : 1 + (inode_number - 2) / fanout;
+}
+
+// helper for layout
+// the number of data blocks an inode holds, not counting its indirect block
+// the last file is always large enough to need an indirect block
+int data_blocks(int inode_number)
+{
+    if (inode_number <= directories)
+    {
+        return (2 + children(inode_number) + ENTRIES - 1) / ENTRIES;
+    }
+    else if (inode_number == allocated - 1 && file_blocks < NDIRECT + 2)
+    {
+        return NDIRECT + 2;
+    }
+
+    return file_blocks;
+}
+
+// helper for plan and layout
+// the number of indirect blocks an inode with the given data blocks needs,
+// counting a double-indirect block and the indirect blocks it lists
+int indirect_blocks(int blocks)
+{
+    int beyond = blocks - NDIRECT - NINDIRECT;
+
+    if (blocks <= NDIRECT)
+    {
+        return 0;
+    }
+    else if (beyond <= 0)
+    {
+        return 1;
+    }
+
+    return 2 + (beyond + NINDIRECT - 1) / NINDIRECT;
+}
+
+// helper for layout
+// the number of the given data block of an inode
+uint *block_address(int inode_number, int i)
+{
+    struct dinode *inode = get_inode(inode_number);
+
+    if (i < NDIRECT)
+    {
+        return &inode->addrs[i];
+    }
+    else if (i < NDIRECT + NINDIRECT)
+    {
+        return (uint *)get_block(inode->addrs[NDIRECT]) + (i - NDIRECT);
+    }
+
+    // past the indirect block, through one of those the double-indirect lists
+    int beyond = i - NDIRECT - NINDIRECT;
+    uint second = ((uint *)get_block(inode->addrs[NDIRECT + DOUBLE_INDIRECT]))[beyond / NINDIRECT];
+
+    return (uint *)get_block(second) + beyond % NINDIRECT;
+}
+
+// helper for layout
+// the given entry of a directory
+struct dirent *directory_entry(int directory, int entry)
+{
+    return (struct dirent *)get_block(*block_address(directory, entry / ENTRIES)) + entry % ENTRIES;
+}
+
+// work out where everything goes, and how large the image is
+void plan()
+{
+    long used = 0;
+    int i;
+
+    allocated = ninodes < USHRT_MAX + 1 ? ninodes : USHRT_MAX + 1;
+    directories = allocated > 2 ? (allocated - 2 + fanout - 1) / fanout : 1;
+
+    for (i = 1; i < allocated; i++)
+    {
+        int blocks = data_blocks(i);
+        if (blocks > MAXFILE)
+        {
+            die("too many blocks for one inode.");
+        }
+        used += blocks + indirect_blocks(blocks);
+    }
+
+    if (used + spare_blocks > INT_MAX / 2)
+    {
+        die("image too large.");
+    }
+    nblocks = used + spare_blocks;
+
+    // the bitmap covers the whole image, so its size depends on itself
+    int bitmap_blocks = 1;
+    bitmap_start = 3 + ninodes / IPB;
+    while (1)
+    {
+        size = bitmap_start + bitmap_blocks + nblocks;
+        if (size / BPB + 1 == bitmap_blocks)
+        {
+            break;
+        }
+        bitmap_blocks = size / BPB + 1;
+    }
+    datablocks_start = bitmap_start + bitmap_blocks;
+}
+
+// fill in the superblock, inodes, directories and bitmap
+void layout()
+{
+    struct superblock *sb = (struct superblock *)get_block(1);
+    int i, j;
+
+    sb->size = size;
+    sb->nblocks = nblocks;
+    sb->ninodes = ninodes;
+
+    next_block = datablocks_start;
+    for (i = 1; i < allocated; i++)
+    {
+        struct dinode *inode = get_inode(i);
+        int blocks = data_blocks(i);
+
+        inode->type = i <= directories ? T_DIR : T_FILE;
+        inode->nlink = 1;
+
+        if (blocks > NDIRECT)
+        {
+            inode->addrs[NDIRECT] = next_block++;
+        }
+        for (j = 0; j < blocks; j++)
+        {
+            // each indirect block the double-indirect lists comes just
+            // before the blocks it lists
+            int beyond = j - NDIRECT - NINDIRECT;
+            if (beyond == 0)
+            {
+                inode->addrs[NDIRECT + DOUBLE_INDIRECT] = next_block++;
+            }
+            if (beyond >= 0 && beyond % NINDIRECT == 0)
+            {
+                ((uint *)get_block(inode->addrs[NDIRECT + DOUBLE_INDIRECT]))[beyond / NINDIRECT] = next_block++;
+            }
+            *block_address(i, j) = next_block++;
+        }
+
+        if (inode->type == T_FILE)
+        {
+            inode->size = blocks * BSIZE;
+            memset(get_block(*block_address(i, 0)), i, BSIZE);
+            continue;
+        }
+
+        struct dirent *entry = directory_entry(i, 0);
+        entry->inum = i;
+        strcpy(entry->name, ".");
+        entry = directory_entry(i, 1);
+        entry->inum = parent(i);
+        strcpy(entry->name, "..");
+
+        int count = children(i);
+        for (j = 0; j < count; j++)
+        {
+            int child = first_child(i) + j;
+            entry = directory_entry(i, 2 + j);
+            entry->inum = child;
+            snprintf(entry->name, DIRSIZ, "%c%d", child <= directories ? 'd' : 'f', child);
+        }
+        inode->size = (2 + count) * sizeof(struct dirent);
+    }
+
+    // as in mkfs, every block up to the last one allocated is marked used
+    for (i = 0; i < next_block; i++)
+    {
+        set_bit(i, 1);
+    }
+}
+
+// helper for inject
+// an unused entry at the end of a directory, to add a link in
+struct dirent *free_entry(int directory, int indirect)
+{
+    int entry = 2 + children(directory);
+
+    if (entry % ENTRIES == 0 || (indirect && entry / ENTRIES < NDIRECT))
+    {
+        die(indirect ? "fault needs a directory with an indirect block, raise -f."
+                     : "fault needs a free directory entry, change -f.");
+    }
+
+    return directory_entry(directory, entry);
+}
+
+// make the image break the rule a test image of the same name breaks
+// the victims are the last file, which has an indirect block, the file
+// before it, and the first directory below the root
+void inject()
+{
+    int large = allocated - 1;
+    int file = allocated - 2;
+    int directory = 2;
+    struct dinode *large_inode = get_inode(large);
+    struct dinode *file_inode = get_inode(file);
+    uint *listed = (uint *)get_block(large_inode->addrs[NDIRECT]);
+
+    if (file <= directories || directory > directories)
+    {
+        die("fault needs two files and two directories, raise -i.");
+    }
+
+    if (strcmp(fault, "badinode") == 0)
+    {
+        large_inode->type = 7;
+    }
+    else if (strcmp(fault, "badaddr") == 0)
+    {
+        large_inode->addrs[0] = size;
+    }
+    else if (strcmp(fault, "badindir1") == 0)
+    {
+        large_inode->addrs[NDIRECT] = size;
+    }
+    else if (strcmp(fault, "badindir2") == 0)
+    {
+        listed[0] = size;
+    }
+    else if (strcmp(fault, "badroot") == 0)
+    {
+        get_inode(ROOTINO)->type = T_FILE;
+    }
+    else if (strcmp(fault, "badroot2") == 0)
+    {
+        directory_entry(ROOTINO, 1)->inum = directory;
+    }
+    else if (strcmp(fault, "badfmt") == 0)
+    {
+        directory_entry(directory, 0)->inum = ROOTINO;
+    }
+    else if (strcmp(fault, "mrkfree") == 0)
+    {
+        set_bit(large_inode->addrs[0], 0);
+    }
+    else if (strcmp(fault, "indirfree") == 0)
+    {
+        set_bit(large_inode->addrs[NDIRECT], 0);
+    }
+    else if (strcmp(fault, "mrkused") == 0)
+    {
+        if (next_block >= datablocks_start + nblocks)
+        {
+            die("fault needs a spare block, raise -s.");
+        }
+        set_bit(next_block, 1);
+    }
+    else if (strcmp(fault, "addronce") == 0)
+    {
+        set_bit(file_inode->addrs[0], 0);
+        file_inode->addrs[0] = large_inode->addrs[0];
+    }
+    else if (strcmp(fault, "addronce2") == 0)
+    {
+        set_bit(listed[1], 0);
+        listed[1] = listed[0];
+    }
+    else if (strcmp(fault, "imrkused") == 0)
+    {
+        directory_entry(parent(file), 2 + file - first_child(parent(file)))->inum = 0;
+    }
+    else if (strcmp(fault, "imrkfree") == 0)
+    {
+        file_inode->type = 0;
+    }
+    else if (strcmp(fault, "badrefcnt") == 0)
+    {
+        file_inode->nlink = 2;
+    }
+    else if (strcmp(fault, "badrefcnt2") == 0)
+    {
+        struct dirent *entry = free_entry(parent(file), 0);
+        entry->inum = file;
+        strcpy(entry->name, "link");
+    }
+    else if (strcmp(fault, "dironce") == 0 || strcmp(fault, "badlarge") == 0)
+    {
+        // for badlarge the link is in a block listed by the indirect block
+        struct dirent *entry = free_entry(ROOTINO, strcmp(fault, "badlarge") == 0);
+        entry->inum = directory;
+        strcpy(entry->name, "again");
+    }
+}
+
+void usage()
+{
+    int i;
+
+    PERROR("Usage: genfs [-i inodes] [-f fanout] [-z file_blocks] [-s spare_blocks] [--fault name] <image>\n"
+           "faults:");
+    for (i = 0; faults[i] != NULL; i++)
+    {
+        PERROR(" %s", faults[i]);
+    }
+    PERROR("\n");
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    struct option options[] = {
+        { "fault", required_argument, NULL, 'F' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    int option, i;
+    while ((option = getopt_long(argc, argv, "i:f:z:s:", options, NULL)) != -1)
+    {
+        switch (option)
+        {
+            case 'i':
+                ninodes = atoi(optarg);
+                break;
+            case 'f':
+                fanout = atoi(optarg);
+                break;
+            case 'z':
+                file_blocks = atoi(optarg);
+                break;
+            case 's':
+                spare_blocks = atoi(optarg);
+                break;
+            case 'F':
+                fault = optarg;
+                break;
+            default:
+                usage();
+        }
+    }
+
+    if (optind >= argc || ninodes < 2 || ninodes > INT_MAX / 2 || fanout < 1 ||
+        file_blocks < 0 || spare_blocks < 0)
+    {
+        usage();
+    }
+
+    for (i = 0; fault != NULL && faults[i] != NULL && strcmp(fault, faults[i]) != 0; i++)
+    {
+    }
+    if (fault != NULL && faults[i] == NULL)
+    {
+        usage();
+    }
+
+    plan();
+
+    int fd = open(argv[optind], O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, (off_t)size * BSIZE) < 0)
+    {
+        die("image could not be created.");
+    }
+
+    image = mmap(NULL, (size_t)size * BSIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (image == MAP_FAILED)
+    {
+        die("image could not be mapped.");
+    }
+
+    layout();
+    if (fault != NULL)
+    {
+        inject();
+    }
+
+    munmap(image, (size_t)size * BSIZE);
+    close(fd);
+
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,7 @@
+// the checker for images with 1024-byte blocks
+
+#define BSIZE 1024
+#define DOUBLE_INDIRECT 0
+#define FCHECK_GEOMETRY fcheck_geometry_1024
+
+#include "../libfcheck.c"
@@ -0,0 +1,7 @@
+// the checker for images with 1024-byte blocks and a double-indirect pointer in each inode
+
+#define BSIZE 1024
+#define DOUBLE_INDIRECT 1
+#define FCHECK_GEOMETRY fcheck_geometry_1024_double
+
+#include "../libfcheck.c"
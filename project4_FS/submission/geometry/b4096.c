@@ -0,0 +1,7 @@
+// the checker for images with 4096-byte blocks
+
+#define BSIZE 4096
+#define DOUBLE_INDIRECT 0
+#define FCHECK_GEOMETRY fcheck_geometry_4096
+
+#include "../libfcheck.c"
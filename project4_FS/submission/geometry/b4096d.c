@@ -0,0 +1,7 @@
+// the checker for images with 4096-byte blocks and a double-indirect pointer in each inode
+
+#define BSIZE 4096
+#define DOUBLE_INDIRECT 1
+#define FCHECK_GEOMETRY fcheck_geometry_4096_double
+
+#include "../libfcheck.c"
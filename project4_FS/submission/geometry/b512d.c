@@ -0,0 +1,7 @@
+// the checker for images with 512-byte blocks and a double-indirect pointer in each inode
+
+#define BSIZE 512
+#define DOUBLE_INDIRECT 1
+#define FCHECK_GEOMETRY fcheck_geometry_512_double
+
+#include "../libfcheck.c"
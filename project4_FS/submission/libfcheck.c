@@ -0,0 +1,4714 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_VECTORS
+#endif
+#include "fs.h"
+#include "libfcheck.h"
+
+// this file is compiled once for the geometry fs.h gives by default, and
+// once more for each file in geometry/, which sets BSIZE and DOUBLE_INDIRECT
+// and names the build's entry point in FCHECK_GEOMETRY; only the default
+// build holds the fcheck_ functions, and hands an image with another
+// geometry to the build for it, so every build keeps its sizes constant
+#ifndef FCHECK_GEOMETRY
+#define DEFAULT_GEOMETRY
+#endif
+
+#define EXIT_SUCCESS 0
+#define EXIT_FAILURE 1
+static uint dirsize = sizeof(struct dirent);
+#define DIRSIZE dirsize
+
+#define UNDO_MAGIC "fcheck undo 2\n"
+#define CACHE_MAGIC "fcheck cache 1\n"
+
+#define PREFETCH_THREADS 4
+
+#define MAX_THREADS FCHECK_MAX_THREADS
+#define NONE FCHECK_NONE
+
+// adds to a counter of the thread doing the work, when stats are wanted
+#define COUNT(fc, counter, n) \
+    do { if ((fc)->stats) (current_worker ? &current_worker->stats : &(fc)->counters)->counter += (n); } while (0)
+
+// the pointers of an inode, in the order a sequential check visits them
+// the pointers an indirect block lists follow its own slot, but in the
+// double-indirect block each listed indirect block is followed by its list
+#define INODE_SLOT 0
+#define DIRECT_SLOT(i) (1 + (i))
+#define INDIRECT_SLOT (NDIRECT + 1)
+#define LISTED_SLOT(slot, i) ((slot) + 1 + (i))
+#define DOUBLE_SLOT LISTED_SLOT(INDIRECT_SLOT, NINDIRECT)
+#define SECOND_SLOT(i) (DOUBLE_SLOT + 1 + (i) * (NINDIRECT + 1))
+#if DOUBLE_INDIRECT
+#define SLOTS SECOND_SLOT(NINDIRECT)
+typedef uint slot_number;
+#else
+#define SLOTS (NDIRECT + 2 + NINDIRECT)
+typedef ushort slot_number;
+#endif
+
+// orders errors as a sequential check would find them: by inode, then by
+// pointer, then by the entry in a directory block the pointer leads to
+#define ENTRIES (BSIZE / sizeof(struct dirent))
+#define ERROR_KEY(inode, slot, entry) \
+    (((uint64_t)(inode) * SLOTS + (slot)) * (ENTRIES + 2) + (entry))
+
+#ifdef DEFAULT_GEOMETRY
+
+static const char *error_messages[FCHECK_ERROR_CLASSES] = {
+    [FCHECK_BAD_INODE] = "bad inode.",
+    [FCHECK_BAD_DIRECT_ADDRESS] = "bad direct address in inode.",
+    [FCHECK_BAD_INDIRECT_ADDRESS] = "bad indirect address in inode.",
+    [FCHECK_NO_ROOT_DIRECTORY] = "root directory does not exist.",
+    [FCHECK_BAD_DIRECTORY_FORMAT] = "directory not properly formatted.",
+    [FCHECK_ADDRESS_MARKED_FREE] = "address used by inode but marked free in bitmap.",
+    [FCHECK_BLOCK_NOT_IN_USE] = "bitmap marks block in use but it is not in use.",
+    [FCHECK_DIRECT_ADDRESS_REUSED] = "direct address used more than once.",
+    [FCHECK_INDIRECT_ADDRESS_REUSED] = "indirect address used more than once.",
+    [FCHECK_INODE_NOT_IN_DIRECTORY] = "inode marked use but not found in a directory.",
+    [FCHECK_INODE_MARKED_FREE] = "inode referred to in directory but marked free.",
+    [FCHECK_BAD_REFERENCE_COUNT] = "bad reference count for file.",
+    [FCHECK_DIRECTORY_REUSED] = "directory appears more than once in file system.",
+    [FCHECK_BLOCK_OUTSIDE_IMAGE] = "block is outside the file system image.",
+    [FCHECK_BAD_SUPERBLOCK] = "superblock does not match the image.",
+    [FCHECK_BITMAP_COUNT] = "bitmap does not match the number of blocks in use.",
+    [FCHECK_DIRECTORY_UNREACHABLE] = "inaccessible directory exists in file system.",
+    [FCHECK_PARENT_MISMATCH] = "parent directory mismatch.",
+    [FCHECK_DIRECTORY_CYCLE] = "directory is its own ancestor.",
+};
+
+// names used for each phase in --stats and --trace
+static const char *phase_names[FCHECK_PHASES] = {
+    [FCHECK_INIT] = "init",
+    [FCHECK_GET_BITMAP_INFO] = "get_bitmap_info",
+    [FCHECK_CHECK_INODES] = "check_inodes",
+    [FCHECK_CHECK_REFERENCES] = "check_references",
+    [FCHECK_CHECK_BITMAP] = "check_bitmap",
+    [FCHECK_CHECK_DIRECTORIES] = "check_directories",
+    [FCHECK_CHECK_REACHABILITY] = "check_reachability",
+    [FCHECK_REPAIR_IMAGE] = "repair_image",
+    [FCHECK_CLEANUP] = "cleanup",
+};
+
+// names used for each class in the report
+static const char *error_names[FCHECK_ERROR_CLASSES] = {
+    [FCHECK_BAD_INODE] = "bad_inode",
+    [FCHECK_BAD_DIRECT_ADDRESS] = "bad_direct_address",
+    [FCHECK_BAD_INDIRECT_ADDRESS] = "bad_indirect_address",
+    [FCHECK_NO_ROOT_DIRECTORY] = "no_root_directory",
+    [FCHECK_BAD_DIRECTORY_FORMAT] = "bad_directory_format",
+    [FCHECK_ADDRESS_MARKED_FREE] = "address_marked_free",
+    [FCHECK_BLOCK_NOT_IN_USE] = "block_not_in_use",
+    [FCHECK_DIRECT_ADDRESS_REUSED] = "direct_address_reused",
+    [FCHECK_INDIRECT_ADDRESS_REUSED] = "indirect_address_reused",
+    [FCHECK_INODE_NOT_IN_DIRECTORY] = "inode_not_in_directory",
+    [FCHECK_INODE_MARKED_FREE] = "inode_marked_free",
+    [FCHECK_BAD_REFERENCE_COUNT] = "bad_reference_count",
+    [FCHECK_DIRECTORY_REUSED] = "directory_reused",
+    [FCHECK_BLOCK_OUTSIDE_IMAGE] = "block_outside_image",
+    [FCHECK_BAD_SUPERBLOCK] = "bad_superblock",
+    [FCHECK_BITMAP_COUNT] = "bitmap_count",
+    [FCHECK_DIRECTORY_UNREACHABLE] = "directory_unreachable",
+    [FCHECK_PARENT_MISMATCH] = "parent_mismatch",
+    [FCHECK_DIRECTORY_CYCLE] = "directory_cycle",
+};
+
+#endif
+
+// errors in the order they were found
+struct error_list
+{
+    struct fcheck_error *records;
+    int count;
+    int capacity;
+};
+
+// what the checker has found about each data block and inode
+// kept as bitsets plus one narrow counter, all in a single allocation, so
+// that the state for a million inodes stays small enough to sit in cache
+struct accounting
+{
+    // per data block, indexed from datablocks_start
+    uint64_t *block_used;         // referenced by some inode
+    uint64_t *block_reused;       // referenced more than once
+    uint64_t *block_indirect;     // an indirect block or listed in one
+
+    // per inode
+    uint64_t *inode_allocated;    // has a file, directory or device type
+    uint64_t *inode_referenced;   // found in some directory
+    uint64_t *directory_linked;   // found under a name other than . or ..
+    uint64_t *directory_relinked; // found under such a name more than once
+    short *reference_count;       // nlink less the names found, saturating
+};
+
+// what a data block is used for
+enum reference_role
+{
+    REF_DATA,
+    REF_DIRECTORY,
+    REF_INDIRECT
+};
+
+#define REF_MARKED 0x01           // the block is marked used in the bitmap
+#define REF_LISTED 0x02           // the block is listed in an indirect block
+#define REF_OWNER_DIRECTORY 0x04  // an indirect block belonging to a directory
+#define REF_DOUBLE 0x08           // a double-indirect block, listing indirect blocks
+
+// a use of an indirect or directory block, queued in ordered mode so that
+// blocks can be visited in disk order rather than inode order
+struct reference
+{
+    uint block;
+    uint inode;
+    slot_number slot;
+    unsigned char role;
+    unsigned char flags;
+};
+
+struct reference_list
+{
+    struct reference *references;
+    long count;
+    long capacity;
+};
+
+// where the walk from the root first found an inode: the directory, and the
+// block and entry of the name; parent is 0 if the walk never found it, and
+// the inode itself for the root and the top of each unreachable tree
+struct link
+{
+    uint parent;
+    uint block;
+    ushort entry;
+};
+
+// one name in a directory, as the name index keeps it
+struct name
+{
+    uint directory;
+    uint inode;
+    uint next;            // the next name of the same inode + 1, or 0
+    char name[DIRSIZ];
+};
+
+// every name the walk found, hashed on its directory and name for
+// fcheck_lookup, and chained by inode for fcheck_whohas
+// the names are copied, so the index outlives the image
+struct fcheck_index
+{
+    struct name *names;
+    uint count;
+    uint capacity;
+    uint *slots;          // a name + 1, or 0 if the slot is empty
+    uint slot_mask;
+    uint *first;          // per inode: its first and last names + 1, or 0
+    uint *last;
+    uint ninodes;
+};
+
+// a part of the image mapped on its own, when it is not mapped whole
+struct window
+{
+    char *base;       // the mapping, or NULL
+    off_t start;      // where in the image it starts
+    size_t length;
+};
+
+#define METADATA_WINDOW 0
+#define DATA_WINDOW 1
+
+// an io_uring, set up with raw system calls
+struct uring
+{
+    int fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    unsigned queued;        // reads in the ring not yet submitted
+};
+
+// reads of directory and indirect blocks the check will soon need, started
+// early so that the page cache has them by the time the mapping is read
+// io_uring keeps depth reads in flight from the checking thread itself;
+// where it cannot be set up, a few threads read with pread instead
+struct prefetcher
+{
+    struct checker *checker;
+    int depth;
+    long next;              // the next inode, or queued reference, to read ahead
+
+    // io_uring, reading into buffers that are thrown away
+    int use_uring;
+    struct uring ring;
+    char *buffers;
+    int *free_slots;
+    int free_count;
+    int in_flight;
+
+    // the threads, taking blocks from a ring of depth
+    pthread_t threads[PREFETCH_THREADS];
+    int thread_count;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    uint *queue;
+    int queue_head;
+    int queue_count;
+    int waiting;            // threads with nothing to read
+    int stopping;
+};
+
+// bytes a repair writes at an offset in the image
+struct patch
+{
+    off_t offset;
+    size_t length;
+    unsigned char *bytes;
+};
+
+struct patch_list
+{
+    struct patch *patches;
+    int count;
+    int capacity;
+};
+
+// numbers an inode block's inodes add to the accounting, in the order found
+struct fact_list
+{
+    uint *facts;
+    uint count;
+    uint capacity;
+};
+
+#define USE_INDIRECT 0x80000000u  // the use is of an indirect block or one listed in one
+#define NAME_DOT 0x80000000u      // the name is . or ..
+
+// what the inodes of one inode block, and the directory and indirect blocks
+// they point to, add to the accounting, as the cache keeps it
+struct block_facts
+{
+    uint64_t digest;          // of the inode block and every block read through it
+    int changed;              // the digest is not the cache's, so the block is checked
+    int has_directory;
+    struct fact_list uses;    // the data blocks used
+    struct fact_list names;   // the inodes named in directories
+};
+
+// the digests and facts of the last clean check, with the cache option
+struct fact_cache
+{
+    struct block_facts *blocks;   // per inode block, from the first
+    long count;
+    uint64_t bitmap_digest;
+    int replayed;                 // some block's facts were taken from the cache
+    int directories_changed;      // a changed block has a directory, before or after
+};
+
+// the start of a cache file, which is followed by a record for each inode
+// block, each followed by its uses and names
+// the file is in the byte order of the machine that wrote it
+struct cache_header
+{
+    char magic[16];
+    uint block_size;
+    uint double_indirect;
+    struct superblock superblock;
+    uint inode_blocks;
+    uint64_t image_size;
+    uint64_t bitmap_digest;
+};
+
+struct cache_record
+{
+    uint64_t digest;
+    uint has_directory;
+    uint use_count;
+    uint name_count;
+};
+
+// what a changed data block is to the inodes of one image
+#define DIFF_FREE 0
+#define DIFF_DATA 1
+#define DIFF_DIRECTORY 2
+#define DIFF_LIST 3    // an indirect block, or one listed in a double-indirect block
+
+struct diff_role
+{
+    uint inode;
+    int kind;
+};
+
+// with fcheck_diff, the image this one is compared with, and what differs
+struct image_diff
+{
+    struct checker *old;
+    void (*visit)(const char *change, void *arg);
+    void *arg;
+    long blocks;               // whole blocks in both images
+    uint64_t *changed;         // the blocks whose bytes differ
+    uint *data_blocks;         // the changed data blocks, in order
+    long data_count;
+    struct diff_role *roles[2];  // per changed data block, in the old and new image
+    long run_first;            // the run of bitmap bits flipped the same way
+    long run_last;
+    int run_marked;
+};
+
+// directories waiting to be walked
+struct directory_stack
+{
+    uint *directories;
+    int count;
+    int capacity;
+};
+
+// everything known about one image being checked
+// each image gets its own checker, so that several can be checked at once
+struct checker
+{
+    // options
+    int threads;
+    int collect_all;
+    int ordered;
+    int stats;
+    int quick;
+    int paths;
+    int keep_index;
+    int repair;
+    const char *undo_log;
+    size_t memory;
+    int prefetch;
+    int block_size;
+    int double_indirect;
+    const char *cache_path;
+
+    // the image, from a path, a file descriptor or a buffer
+    const char *image_path;
+    int opened;       // open_image has run, maybe in the default build
+    int laid_out;     // init found the superblock's layout inside the image
+    int fsfd;
+    int close_image;  // the image was opened here, so it is closed here
+    int unmap_image;  // the image was mapped here, so it is unmapped here
+    struct stat file_stat;
+    char *mem_map_image;
+    int spilled;      // the image could not be seeked, so it was copied
+    int windowed;     // with --mem, read through windows instead of mem_map_image
+    struct window windows[2];
+    size_t window_size;
+    long queue_limit; // with --mem, the blocks queued before they are visited
+    struct superblock superblock;
+    int datablocks_start;
+    int datablocks_end;
+    int bitmap_start;
+    int bitmap_bits;
+    uint64_t *bitmap;
+
+    // what has been found
+    struct accounting accounting;
+    struct reference_list references;
+    struct link *links;             // from the walk from the root
+    uint64_t *walked;               // directories the walk has reached
+    struct directory_stack stack;
+    struct fcheck_index *index;     // names from the walk, with the index option
+    struct error_list errors;
+    struct patch_list patches;      // with the repair option, what to write
+    struct fact_cache cache;        // with the cache option
+    struct image_diff diff;         // with fcheck_diff
+    long blocks_in_use;   // with --quick, the data blocks inodes point to
+    const char *problem;  // why the image could not be checked at all
+    int defer_errors;
+    int failed_worker;
+    jmp_buf abort;        // where the first error ends the check
+
+    // what each phase did, with --stats
+    double started;
+    int phase;                      // the phase running, or NONE
+    struct fcheck_stats counters;   // totals so far
+    struct fcheck_stats counted;    // totals when the phase began
+    struct fcheck_stats phases[FCHECK_PHASES];
+    struct fcheck_stats workers[MAX_THREADS];
+    int worker_count;
+};
+
+// a thread checking a contiguous range of inode blocks
+struct worker
+{
+    pthread_t thread;
+    struct checker *checker;
+    int index;
+    int first_block;
+    int last_block;
+    struct error_list errors;
+    struct fcheck_stats stats;
+};
+
+static __thread struct worker *current_worker;
+static __thread struct prefetcher *current_prefetcher;
+static __thread struct block_facts *current_facts;
+static __thread uint64_t error_key;
+
+static void check_indirect_block(struct checker *fc, int inode_number, int indirect, int slot, int flags);
+static void add_reference(struct checker *fc, int block, int inode_number, int slot, int role, int flags);
+
+// seconds on a clock that only moves forward
+static double now()
+{
+    struct timespec time;
+
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+// helps add the counts of one set of stats to another
+static void add_stats(struct fcheck_stats *to, const struct fcheck_stats *from, int sign)
+{
+    to->blocks_read += sign * from->blocks_read;
+    to->bytes_touched += sign * from->bytes_touched;
+    to->syscalls += sign * from->syscalls;
+    to->directory_blocks += sign * from->directory_blocks;
+    to->indirect_blocks += sign * from->indirect_blocks;
+    to->data_blocks += sign * from->data_blocks;
+}
+
+// helper for check_image
+// close the phase that is running, if any, and start the given one
+static void begin_phase(struct checker *fc, int phase)
+{
+    if (!fc->stats)
+    {
+        return;
+    }
+
+    double time = now() - fc->started;
+
+    if (fc->phase != NONE)
+    {
+        struct fcheck_stats *stats = &fc->phases[fc->phase];
+        stats->seconds = time - stats->start;
+        *stats = (struct fcheck_stats){ .start = stats->start, .seconds = stats->seconds };
+        add_stats(stats, &fc->counters, 1);
+        add_stats(stats, &fc->counted, -1);
+    }
+
+    fc->phase = phase;
+    if (phase != NONE)
+    {
+        fc->phases[phase].start = time;
+        fc->counted = fc->counters;
+    }
+}
+
+// stop checking an image when memory runs out
+// a worker only stops itself, main gives up once every worker has finished
+static void out_of_memory(struct checker *fc)
+{
+    __atomic_store_n(&fc->problem, "out of memory.", __ATOMIC_RELAXED);
+    if (current_worker != NULL)
+    {
+        pthread_exit(NULL);
+    }
+    longjmp(fc->abort, 1);
+}
+
+// helps add an error to the end of a list
+static void add_error(struct checker *fc, struct error_list *list, struct fcheck_error record)
+{
+    if (list->count == list->capacity)
+    {
+        int capacity = list->capacity ? list->capacity * 2 : 16;
+        struct fcheck_error *records = realloc(list->records, capacity * sizeof(struct fcheck_error));
+        if (records == NULL)
+        {
+            out_of_memory(fc);
+        }
+        list->records = records;
+        list->capacity = capacity;
+    }
+
+    list->records[list->count++] = record;
+}
+
+// report an error found while checking
+// by default the first error ends the check; with --all, or while ordered
+// mode is visiting blocks out of inode order, it is recorded and the caller
+// carries on. in a worker thread the error is kept for main to
+// report, so that the verdict is the same as a single-threaded run
+static void fail(struct checker *fc, int error, long inode_number, long block)
+{
+    struct fcheck_error record = { error, inode_number, block, error_key, NULL, 0 };
+
+    if (current_worker == NULL)
+    {
+        add_error(fc, &fc->errors, record);
+        if (!fc->collect_all && !fc->defer_errors)
+        {
+            longjmp(fc->abort, 1);
+        }
+        return;
+    }
+
+    add_error(fc, &current_worker->errors, record);
+    if (fc->collect_all)
+    {
+        return;
+    }
+
+    // workers after this one can stop, their errors can no longer be first
+    int failed = __atomic_load_n(&fc->failed_worker, __ATOMIC_RELAXED);
+    while (current_worker->index < failed &&
+           !__atomic_compare_exchange_n(&fc->failed_worker, &failed, current_worker->index,
+                                        0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+
+    pthread_exit(NULL);
+}
+
+// stop checking an image that cannot be checked at all
+static void give_up(struct checker *fc, const char *problem)
+{
+    fc->problem = problem;
+    longjmp(fc->abort, 1);
+}
+
+// helps get part of the image, already known to be inside it
+// with --mem the image is not mapped whole: metadata and data blocks each go
+// through a window of their own, which is mapped again wherever a read falls
+// outside it, so a pointer from one window stays good while the other moves
+static char *image_at(struct checker *fc, off_t offset, size_t length)
+{
+    if (!fc->windowed)
+    {
+        return fc->mem_map_image + offset;
+    }
+
+    int data = fc->datablocks_start > 0 && offset >= (off_t)fc->datablocks_start * BSIZE;
+    struct window *window = &fc->windows[data ? DATA_WINDOW : METADATA_WINDOW];
+
+    if (window->base == NULL || offset < window->start ||
+        offset + (off_t)length > window->start + (off_t)window->length)
+    {
+        if (window->base != NULL)
+        {
+            COUNT(fc, syscalls, 1);
+            munmap(window->base, window->length);
+            window->base = NULL;
+        }
+
+        off_t start = offset - offset % sysconf(_SC_PAGESIZE);
+        size_t size = fc->window_size;
+        if (size < offset + length - start)
+        {
+            size = offset + length - start;
+        }
+        if (start + (off_t)size > fc->file_stat.st_size)
+        {
+            size = fc->file_stat.st_size - start;
+        }
+
+        // the inode table is read straight through, so it is read ahead a
+        // whole window at a time; data blocks are read in disk order but
+        // sparsely, so the kernel's own read-ahead decides
+        COUNT(fc, syscalls, 2);
+        char *base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fc->fsfd, start);
+        if (base == MAP_FAILED)
+        {
+            give_up(fc, "image could not be mapped.");
+        }
+        madvise(base, size, data ? MADV_SEQUENTIAL : MADV_WILLNEED);
+        *window = (struct window){ base, start, size };
+    }
+
+    return window->base + (offset - window->start);
+}
+
+// helps get a requested block
+// returns a pointer into the image mapping, so no copy or syscall is made,
+// or NULL if the block is not in the image and errors are being collected
+static char *get_block(struct checker *fc, int block)
+{
+    if (block < 0 || (off_t)(block + 1) * BSIZE > fc->file_stat.st_size)
+    {
+        fail(fc, FCHECK_BLOCK_OUTSIDE_IMAGE, NONE, block);
+        return NULL;
+    }
+
+    COUNT(fc, blocks_read, 1);
+    COUNT(fc, bytes_touched, BSIZE);
+
+    return image_at(fc, (off_t)block * BSIZE, BSIZE);
+}
+
+// helps get a requested inode
+static struct dinode *get_inode(struct checker *fc, int inode_number)
+{
+    struct dinode *inode_block = (struct dinode *)get_block(fc, IBLOCK(inode_number));
+
+    if (inode_block == NULL)
+    {
+        return NULL;
+    }
+
+    return inode_block + (inode_number % IPB);
+}
+
+// helps test a bit in a bitset
+static int bitset_test(uint64_t *set, int i)
+{
+    return (set[i / 64] >> (i % 64)) & 1;
+}
+
+// helps set a bit in a bitset, atomically when more than one thread is checking
+// returns the bit's previous value
+static int bitset_mark(struct checker *fc, uint64_t *set, int i)
+{
+    uint64_t mask = (uint64_t)1 << (i % 64);
+    uint64_t old;
+
+    if (fc->threads > 1)
+    {
+        old = __atomic_fetch_or(&set[i / 64], mask, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        old = set[i / 64];
+        set[i / 64] = old | mask;
+    }
+
+    return (old & mask) != 0;
+}
+
+// helps add to a reference count, clamping it to the range of a short
+// a count that has saturated can never come back to zero, so a bad count is
+// still reported as bad
+static void count_references(struct checker *fc, int inode_number, int delta)
+{
+    short *counter = &fc->accounting.reference_count[inode_number];
+    short old = *counter;
+    short new;
+
+    do
+    {
+        int sum = old + delta;
+        new = sum > SHRT_MAX ? SHRT_MAX : sum < SHRT_MIN ? SHRT_MIN : sum;
+
+        if (fc->threads == 1)
+        {
+            *counter = new;
+            return;
+        }
+    } while (!__atomic_compare_exchange_n(counter, &old, new, 0,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// helps test a block's bit in the in-memory copy of the bitmap
+static int bitmap_test(struct checker *fc, int block)
+{
+    if (block < 0 || block >= fc->bitmap_bits)
+    {
+        return 0;
+    }
+
+    return bitset_test(fc->bitmap, block);
+}
+
+// helps record a reference to a data block
+static void mark_block(struct checker *fc, int block)
+{
+    int i = block - fc->datablocks_start;
+
+    if (bitset_mark(fc, fc->accounting.block_used, i))
+    {
+        bitset_mark(fc, fc->accounting.block_reused, i);
+    }
+}
+
+// helps record that an inode was found in a directory
+static void mark_inode(struct checker *fc, int inode_number)
+{
+    bitset_mark(fc, fc->accounting.inode_referenced, inode_number);
+}
+
+// helper for the prefetcher
+// set up an io_uring with raw system calls and map its rings
+// returns 0, or -1 if the kernel does not allow it
+static int uring_setup(struct uring *ring, unsigned entries)
+{
+    struct io_uring_params params;
+
+    memset(&params, 0, sizeof(params));
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0)
+    {
+        return -1;
+    }
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+        {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_ring = params.features & IORING_FEAT_SINGLE_MMAP ? ring->sq_ring :
+                    mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED)
+    {
+        if (ring->sq_ring != MAP_FAILED)
+        {
+            munmap(ring->sq_ring, ring->sq_ring_size);
+        }
+        if (ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+        {
+            munmap(ring->cq_ring, ring->cq_ring_size);
+        }
+        if (ring->sqes != MAP_FAILED)
+        {
+            munmap(ring->sqes, ring->sqes_size);
+        }
+        close(ring->fd);
+        return -1;
+    }
+
+    char *sq = ring->sq_ring, *cq = ring->cq_ring;
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+    return 0;
+}
+
+// helper for the prefetcher
+// submit the reads queued in the ring, and with wait, wait for one to finish
+// returns -1 if the kernel refused
+static int uring_enter(struct checker *fc, struct uring *ring, int wait)
+{
+    COUNT(fc, syscalls, 1);
+    int submitted = syscall(__NR_io_uring_enter, ring->fd, ring->queued, wait,
+                            wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+
+    if (submitted < 0)
+    {
+        return errno == EINTR || errno == EAGAIN || errno == EBUSY ? 0 : -1;
+    }
+    ring->queued -= submitted;
+
+    return 0;
+}
+
+// helper for the prefetcher
+// one of the threads that read blocks when there is no io_uring
+static void *prefetch_thread(void *arg)
+{
+    struct prefetcher *pf = (struct prefetcher *)arg;
+    char buffer[BSIZE];
+
+    pthread_mutex_lock(&pf->lock);
+    while (!pf->stopping)
+    {
+        if (pf->queue_count == 0)
+        {
+            pf->waiting++;
+            pthread_cond_wait(&pf->work, &pf->lock);
+            pf->waiting--;
+            continue;
+        }
+
+        uint block = pf->queue[pf->queue_head];
+        pf->queue_head = (pf->queue_head + 1) % pf->depth;
+        pf->queue_count--;
+        pthread_mutex_unlock(&pf->lock);
+
+        // only the page cache is wanted, not the bytes
+        ssize_t got = pread(pf->checker->fsfd, buffer, BSIZE, (off_t)block * BSIZE);
+        (void)got;
+
+        pthread_mutex_lock(&pf->lock);
+    }
+    pthread_mutex_unlock(&pf->lock);
+
+    return NULL;
+}
+
+// start reading ahead for the calling thread, if the options ask for it
+// io_uring is used unless FCHECK_IO=pool asks for the threads, or the kernel
+// does not allow it; a prefetcher that cannot start only means no read-ahead
+static void start_prefetch(struct checker *fc)
+{
+    const char *wanted = getenv("FCHECK_IO");
+    struct prefetcher *pf;
+    int i;
+
+    if (fc->prefetch == 0 || fc->fsfd < 0 || (pf = calloc(1, sizeof(struct prefetcher))) == NULL)
+    {
+        return;
+    }
+    pf->checker = fc;
+    pf->depth = fc->prefetch;
+
+    if ((wanted == NULL || strcmp(wanted, "pool") != 0) && uring_setup(&pf->ring, pf->depth) == 0)
+    {
+        pf->buffers = malloc((size_t)pf->depth * BSIZE);
+        pf->free_slots = malloc(pf->depth * sizeof(int));
+        if (pf->buffers == NULL || pf->free_slots == NULL)
+        {
+            free(pf->buffers);
+            free(pf->free_slots);
+            pf->buffers = NULL;
+            pf->free_slots = NULL;
+            pf->free_count = 0;
+        }
+        for (i = 0; pf->free_slots != NULL && i < pf->depth; i++)
+        {
+            pf->free_slots[pf->free_count++] = i;
+        }
+        pf->use_uring = 1;
+    }
+    else if ((pf->queue = malloc(pf->depth * sizeof(uint))) != NULL)
+    {
+        pthread_mutex_init(&pf->lock, NULL);
+        pthread_cond_init(&pf->work, NULL);
+        for (i = 0; i < PREFETCH_THREADS; i++)
+        {
+            if (pthread_create(&pf->threads[i], NULL, prefetch_thread, pf) == 0)
+            {
+                pf->thread_count++;
+            }
+        }
+    }
+
+    current_prefetcher = pf;
+}
+
+// helper for the prefetcher
+// take back the buffers of the reads io_uring has finished
+// with wait, also wait for every read in flight, since the kernel may still
+// write to their buffers
+// returns -1 if the reads can no longer be waited for
+static int reap_prefetches(struct checker *fc, struct prefetcher *pf, int wait)
+{
+    struct uring *ring = &pf->ring;
+
+    for (;;)
+    {
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+        while (head != tail)
+        {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            pf->free_slots[pf->free_count++] = cqe->user_data;
+            pf->in_flight--;
+            head++;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+
+        if (!wait || pf->in_flight == 0)
+        {
+            return 0;
+        }
+        if (uring_enter(fc, ring, 1) < 0)
+        {
+            return -1;
+        }
+    }
+}
+
+// stop reading ahead for the calling thread
+static void stop_prefetch(struct checker *fc)
+{
+    struct prefetcher *pf = current_prefetcher;
+    int i;
+
+    if (pf == NULL)
+    {
+        return;
+    }
+    current_prefetcher = NULL;
+
+    if (pf->use_uring)
+    {
+        // buffers the kernel could still write to are never freed
+        if (pf->free_slots == NULL || reap_prefetches(fc, pf, 1) == 0)
+        {
+            free(pf->buffers);
+        }
+        munmap(pf->ring.sqes, pf->ring.sqes_size);
+        if (pf->ring.cq_ring != pf->ring.sq_ring)
+        {
+            munmap(pf->ring.cq_ring, pf->ring.cq_ring_size);
+        }
+        munmap(pf->ring.sq_ring, pf->ring.sq_ring_size);
+        close(pf->ring.fd);
+        free(pf->free_slots);
+    }
+    else if (pf->queue != NULL)
+    {
+        pthread_mutex_lock(&pf->lock);
+        pf->stopping = 1;
+        pthread_cond_broadcast(&pf->work);
+        pthread_mutex_unlock(&pf->lock);
+        for (i = 0; i < pf->thread_count; i++)
+        {
+            pthread_join(pf->threads[i], NULL);
+        }
+        pthread_mutex_destroy(&pf->lock);
+        pthread_cond_destroy(&pf->work);
+        free(pf->queue);
+    }
+
+    free(pf);
+}
+
+// helper for prefetch_inodes and prefetch_references
+// the number of reads that can still be started
+static int prefetch_room(struct prefetcher *pf)
+{
+    if (pf->use_uring)
+    {
+        return pf->free_count;
+    }
+
+    if (pf->thread_count == 0)
+    {
+        return 0;
+    }
+
+    pthread_mutex_lock(&pf->lock);
+    int room = pf->depth - pf->queue_count;
+    pthread_mutex_unlock(&pf->lock);
+
+    return room;
+}
+
+// helper for prefetch_inodes and prefetch_references
+// start reading a block, which there must be room for
+static void prefetch_block(struct prefetcher *pf, uint block)
+{
+    if (pf->use_uring)
+    {
+        struct uring *ring = &pf->ring;
+        int slot = pf->free_slots[--pf->free_count];
+        unsigned tail = *ring->sq_tail;
+        unsigned index = tail & *ring->sq_mask;
+        struct io_uring_sqe *sqe = &ring->sqes[index];
+
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = pf->checker->fsfd;
+        sqe->addr = (uint64_t)(uintptr_t)(pf->buffers + (size_t)slot * BSIZE);
+        sqe->len = BSIZE;
+        sqe->off = (uint64_t)block * BSIZE;
+        sqe->user_data = slot;
+        ring->sq_array[index] = index;
+        __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+        ring->queued++;
+        pf->in_flight++;
+        return;
+    }
+
+    pthread_mutex_lock(&pf->lock);
+    pf->queue[(pf->queue_head + pf->queue_count++) % pf->depth] = block;
+    pthread_mutex_unlock(&pf->lock);
+}
+
+// helper for prefetch_inodes and prefetch_references
+// start the reads queued since the last call, with one system call or one
+// wakeup rather than one per block
+static void submit_prefetches(struct checker *fc, struct prefetcher *pf)
+{
+    if (pf->use_uring && pf->ring.queued > 0)
+    {
+        uring_enter(fc, &pf->ring, 0);
+    }
+    else if (!pf->use_uring && pf->thread_count > 0)
+    {
+        pthread_mutex_lock(&pf->lock);
+        if (pf->waiting > 0 && pf->queue_count > 0)
+        {
+            pthread_cond_broadcast(&pf->work);
+        }
+        pthread_mutex_unlock(&pf->lock);
+    }
+}
+
+// helper for check_inode_blocks
+// read ahead the directory and indirect blocks of the inodes in the next
+// inode blocks, up to depth blocks past the one being checked, so that the
+// reads are in flight while these inodes are checked
+// only used when the whole image is mapped, so no window moves
+static void prefetch_inodes(struct checker *fc, int block, int last_block)
+{
+    struct prefetcher *pf = current_prefetcher;
+    long first = (long)(block - IBLOCK(0)) * IPB;
+    long end = (long)(last_block + 1 - IBLOCK(0)) * IPB;
+    int i;
+
+    if (pf == NULL || fc->windowed)
+    {
+        return;
+    }
+    if (pf->use_uring && pf->free_slots != NULL)
+    {
+        reap_prefetches(fc, pf, 0);
+    }
+
+    if (end > first + (long)pf->depth * IPB)
+    {
+        end = first + (long)pf->depth * IPB;
+    }
+    if (end > fc->superblock.ninodes)
+    {
+        end = fc->superblock.ninodes;
+    }
+    if (pf->next < first)
+    {
+        pf->next = first;
+    }
+
+    for (; pf->next < end; pf->next++)
+    {
+        if ((off_t)(IBLOCK(pf->next) + 1) * BSIZE > fc->file_stat.st_size)
+        {
+            break;
+        }
+        struct dinode *inode = (struct dinode *)image_at(fc, (off_t)IBLOCK(pf->next) * BSIZE, BSIZE) +
+                               pf->next % IPB;
+        uint wanted[NDIRECT + 1 + DOUBLE_INDIRECT];
+        int count = 0;
+
+        for (i = 0; inode->type == T_DIR && i < NDIRECT; i++)
+        {
+            if (inode->addrs[i] >= (uint)fc->datablocks_start && inode->addrs[i] < (uint)fc->datablocks_end)
+            {
+                wanted[count++] = inode->addrs[i];
+            }
+        }
+        for (i = NDIRECT; (inode->type == T_DIR || inode->type == T_FILE) && i <= NDIRECT + DOUBLE_INDIRECT; i++)
+        {
+            if (inode->addrs[i] >= (uint)fc->datablocks_start && inode->addrs[i] < (uint)fc->datablocks_end)
+            {
+                wanted[count++] = inode->addrs[i];
+            }
+        }
+
+        // an inode's blocks are read ahead together, or not yet
+        if (count > prefetch_room(pf))
+        {
+            break;
+        }
+        for (i = 0; i < count; i++)
+        {
+            prefetch_block(pf, wanted[i]);
+        }
+    }
+
+    submit_prefetches(fc, pf);
+}
+
+// helper for visit_references
+// read ahead the blocks with the given role among the next depth queued
+// references, from reference i on
+static void prefetch_references(struct checker *fc, long i, int role)
+{
+    struct prefetcher *pf = current_prefetcher;
+
+    if (pf == NULL)
+    {
+        return;
+    }
+    if (pf->use_uring && pf->free_slots != NULL)
+    {
+        reap_prefetches(fc, pf, 0);
+    }
+
+    if (pf->next < i)
+    {
+        pf->next = i;
+    }
+    for (; pf->next < fc->references.count && pf->next < i + pf->depth; pf->next++)
+    {
+        struct reference *reference = &fc->references.references[pf->next];
+
+        if (reference->role == role)
+        {
+            if (prefetch_room(pf) == 0)
+            {
+                break;
+            }
+            prefetch_block(pf, reference->block);
+        }
+    }
+
+    submit_prefetches(fc, pf);
+}
+
+// helper for check_type and use_block
+// with the cache option, note something an inode block being checked adds
+// to the accounting, so that the next check can add it without reading
+static void add_fact(struct checker *fc, struct fact_list *list, uint fact)
+{
+    if (list->count == list->capacity)
+    {
+        uint capacity = list->capacity ? list->capacity * 2 : 64;
+        uint *facts = realloc(list->facts, capacity * sizeof(uint));
+        if (facts == NULL)
+        {
+            out_of_memory(fc);
+        }
+        list->facts = facts;
+        list->capacity = capacity;
+    }
+
+    list->facts[list->count++] = fact;
+}
+
+// helper for check_directory
+// make sure the given inode exists and update its number of references
+// returns 1 if the inode is in use
+static int check_type(struct checker *fc, int inode_number, char *name, int addr)
+{
+    struct dinode *inode = NULL;
+
+    if (current_facts != NULL)
+    {
+        int dot = strcmp(name, ".") == 0 || strcmp(name, "..") == 0;
+        add_fact(fc, &current_facts->names, (uint)inode_number | (dot ? NAME_DOT : 0));
+    }
+
+    if (inode_number < fc->superblock.ninodes)
+    {
+        inode = get_inode(fc, inode_number);
+    }
+
+    if (inode == NULL || inode->type <= 0)
+    {
+        fail(fc, FCHECK_INODE_MARKED_FREE, inode_number, addr);
+        return 0;
+    }
+    else
+    {
+        if (inode->type == T_FILE)
+        {
+            count_references(fc, inode_number, -1);
+        }
+        else if (inode->type == T_DIR)
+        {
+            if (strcmp(name, ".") != 0 && strcmp(name, "..") != 0)
+            {
+                if (bitset_mark(fc, fc->accounting.directory_linked, inode_number))
+                {
+                    bitset_mark(fc, fc->accounting.directory_relinked, inode_number);
+                }
+            }
+        }
+    }
+
+    return 1;
+}
+
+// helper for check_direct_pointers and check_indirect_pointers
+// make sure the given block's bit is set correctly
+// returns 1 if the block is marked used
+static int check_block(struct checker *fc, int inode_number, int block)
+{
+    if (!bitmap_test(fc, block))
+    {
+        fail(fc, FCHECK_ADDRESS_MARKED_FREE, inode_number, block);
+        return 0;
+    }
+
+    return 1;
+}
+
+// helper for use_block and check_references
+// make sure the given directory is properly formatted
+// slot is the pointer the block was found through; the first direct block
+// must start with . and ..
+static void check_directory(struct checker *fc, int inode_number, int addr, int slot)
+{
+    int root_directory = slot == DIRECT_SLOT(0);
+
+    // get the data block for the directory from the image
+    error_key = ERROR_KEY(inode_number, slot, 1);
+    char *buf = get_block(fc, addr);
+
+    if (buf == NULL)
+    {
+        return;
+    }
+    COUNT(fc, directory_blocks, 1);
+
+    if (root_directory == 1)
+    {
+        struct dirent *current_dir = (struct dirent *)buf;
+        struct dirent *parent_dir = (struct dirent *)(buf + sizeof(struct dirent));
+
+        ushort current_dir_inum = current_dir->inum;
+        ushort parent_dir_inum = parent_dir->inum;
+
+        // Checking for root directory
+        if (inode_number == 1)
+        {
+            if (current_dir_inum != 1 || parent_dir_inum != 1)
+            {
+                fail(fc, FCHECK_NO_ROOT_DIRECTORY, inode_number, addr);
+            }
+        }
+        // Checking that current directory refers to itself
+        else if (inode_number != current_dir_inum)
+        {
+            fail(fc, FCHECK_BAD_DIRECTORY_FORMAT, inode_number, addr);
+        }
+
+        if (check_type(fc, current_dir_inum, current_dir->name, addr) && current_dir_inum != 0)
+        {
+            mark_inode(fc, current_dir_inum);
+        }
+
+        if (check_type(fc, parent_dir_inum, parent_dir->name, addr) && parent_dir_inum != 0)
+        {
+            mark_inode(fc, parent_dir_inum);
+        }
+    }
+
+    int start = 0;
+    // Updating the inodes used
+    if (root_directory)
+    {
+        start = 2;
+    }
+
+    int max_directories = BSIZE / DIRSIZE;
+    struct dirent *entry;
+
+    int dir;
+    for (dir = start; dir < max_directories; dir++)
+    {
+        entry = (struct dirent *)((dir * DIRSIZE) + buf);
+        error_key = ERROR_KEY(inode_number, slot, 2 + dir);
+
+        switch (entry->inum) {
+            case 0:
+                continue;
+            default:
+                if (check_type(fc, entry->inum, entry->name, addr))
+                {
+                    mark_inode(fc, entry->inum);
+                }
+        }
+    }
+}
+
+// helper for check_inode_blocks and check_indirect_block
+// record a use of a data block by the given inode
+// in ordered mode a use of an indirect or directory block is only collected
+// here, and the block is visited later in disk order by check_references;
+// file data is never read, so it is accounted for right away
+static void use_block(struct checker *fc, int inode_number, int block, int slot, int role, int flags)
+{
+    // make sure block is marked used in bitmap
+    if (check_block(fc, inode_number, block))
+    {
+        flags |= REF_MARKED;
+    }
+
+    if (role == REF_DATA)
+    {
+        COUNT(fc, data_blocks, 1);
+    }
+
+    if (current_facts != NULL)
+    {
+        add_fact(fc, &current_facts->uses,
+                 (uint)block | ((flags & REF_LISTED) || role == REF_INDIRECT ? USE_INDIRECT : 0));
+    }
+
+    if (fc->ordered && role != REF_DATA)
+    {
+        add_reference(fc, block, inode_number, slot, role, flags);
+        return;
+    }
+
+    if ((flags & REF_LISTED) || role == REF_INDIRECT)
+    {
+        bitset_mark(fc, fc->accounting.block_indirect, block - fc->datablocks_start);
+    }
+
+    // update number of bitmap references
+    if (flags & REF_MARKED)
+    {
+        mark_block(fc, block);
+    }
+
+    // if a directory, make sure it is properly formatted
+    if (role == REF_DIRECTORY)
+    {
+        check_directory(fc, inode_number, block, slot);
+    }
+    else if (role == REF_INDIRECT)
+    {
+        check_indirect_block(fc, inode_number, block, slot, flags);
+    }
+}
+
+// helper for check_inodes
+// check the given inode's direct pointers
+static void check_direct_pointers(struct checker *fc, struct dinode *inode, int inode_number)
+{
+    int i, block_addr;
+    int role = inode->type == T_DIR ? REF_DIRECTORY : REF_DATA;
+
+    for (i = 0; i < NDIRECT; i++)
+    {
+        block_addr = inode->addrs[i];
+        error_key = ERROR_KEY(inode_number, DIRECT_SLOT(i), 0);
+
+        if (block_addr == 0)
+        {
+            continue;
+        }
+        else if (block_addr < fc->datablocks_start || block_addr >= fc->datablocks_end)
+        {
+            fail(fc, FCHECK_BAD_DIRECT_ADDRESS, inode_number, (uint)block_addr);
+        }
+        else
+        {
+            use_block(fc, inode_number, block_addr, DIRECT_SLOT(i), role, 0);
+        }
+    }
+}
+
+// helper for use_block and check_references
+// check the pointers listed in the given indirect block, found at slot
+// those a double-indirect block lists are indirect blocks themselves
+static void check_indirect_block(struct checker *fc, int inode_number, int indirect, int slot, int flags)
+{
+    int role = flags & REF_OWNER_DIRECTORY ? REF_DIRECTORY : REF_DATA;
+    int listed_flags = REF_LISTED;
+
+    if (DOUBLE_INDIRECT && (flags & REF_DOUBLE))
+    {
+        role = REF_INDIRECT;
+        listed_flags |= flags & REF_OWNER_DIRECTORY;
+    }
+
+    error_key = ERROR_KEY(inode_number, slot, 0);
+    uint *addrs = (uint *)get_block(fc, indirect);
+    if (addrs != NULL)
+    {
+        COUNT(fc, indirect_blocks, 1);
+    }
+
+    if (addrs == NULL)
+    {
+        return;
+    }
+
+    int i, block_addr, listed_slot;
+    for (i = 0; i < NINDIRECT; i++)
+    {
+        block_addr = addrs[i];
+        listed_slot = DOUBLE_INDIRECT && (flags & REF_DOUBLE) ? SECOND_SLOT(i) : LISTED_SLOT(slot, i);
+        error_key = ERROR_KEY(inode_number, listed_slot, 0);
+
+        if (block_addr == 0)
+        {
+            continue;
+        }
+        else if (block_addr < fc->datablocks_start || block_addr >= fc->datablocks_end)
+        {
+            fail(fc, FCHECK_BAD_INDIRECT_ADDRESS, inode_number, (uint)block_addr);
+        }
+        else
+        {
+            use_block(fc, inode_number, block_addr, listed_slot, role, listed_flags);
+        }
+    }
+}
+
+// helper for check_inodes
+// check the given inode's indirect pointer, then its double-indirect one if
+// inodes have one
+static void check_indirect_pointers(struct checker *fc, struct dinode *inode, int inode_number)
+{
+    int owner = inode->type == T_DIR ? REF_OWNER_DIRECTORY : 0;
+    int i;
+
+    for (i = 0; i <= DOUBLE_INDIRECT; i++)
+    {
+        int indirect = inode->addrs[NDIRECT + i];
+        int slot = i ? DOUBLE_SLOT : INDIRECT_SLOT;
+        error_key = ERROR_KEY(inode_number, slot, 0);
+
+        if (indirect == 0) {
+            // do nothing
+        }
+        else if (indirect < fc->datablocks_start || indirect >= fc->datablocks_end)
+        {
+            fail(fc, FCHECK_BAD_INDIRECT_ADDRESS, inode_number, (uint)indirect);
+        }
+        else
+        {
+            use_block(fc, inode_number, indirect, slot, REF_INDIRECT, owner | (i ? REF_DOUBLE : 0));
+        }
+    }
+}
+
+// helper for use_block
+// add a use of a data block to the list visited in disk order
+static void add_reference(struct checker *fc, int block, int inode_number, int slot, int role, int flags)
+{
+    if (fc->references.count == fc->references.capacity)
+    {
+        long capacity = fc->references.capacity ? fc->references.capacity * 2 : 1024;
+        struct reference *references = realloc(fc->references.references,
+                                               capacity * sizeof(struct reference));
+        if (references == NULL)
+        {
+            out_of_memory(fc);
+        }
+        fc->references.references = references;
+        fc->references.capacity = capacity;
+    }
+
+    struct reference *reference = &fc->references.references[fc->references.count++];
+    reference->block = block;
+    reference->inode = inode_number;
+    reference->slot = slot;
+    reference->role = role;
+    reference->flags = flags;
+}
+
+// helper for check_references
+// sort the collected uses by block number
+// a stable radix sort on 16 bits at a time, so that uses of the same block
+// stay in the order they were found
+static void sort_references(struct checker *fc)
+{
+    struct reference *from = fc->references.references;
+    struct reference *to = malloc(fc->references.count * sizeof(struct reference));
+    long *counts = malloc((1 << 16) * sizeof(long));
+    long i;
+    int shift;
+
+    if ((to == NULL && fc->references.count > 0) || counts == NULL)
+    {
+        free(to);
+        free(counts);
+        out_of_memory(fc);
+    }
+
+    for (shift = 0; shift < 32; shift += 16)
+    {
+        memset(counts, 0, (1 << 16) * sizeof(long));
+        for (i = 0; i < fc->references.count; i++)
+        {
+            counts[(from[i].block >> shift) & 0xffff]++;
+        }
+
+        long total = 0;
+        for (i = 0; i < (1 << 16); i++)
+        {
+            long count = counts[i];
+            counts[i] = total;
+            total += count;
+        }
+
+        for (i = 0; i < fc->references.count; i++)
+        {
+            to[counts[(from[i].block >> shift) & 0xffff]++] = from[i];
+        }
+
+        struct reference *swap = from;
+        from = to;
+        to = swap;
+    }
+
+    // after an even number of passes the sorted list is back in place
+    free(to);
+    free(counts);
+}
+
+// helper for check_references
+// compares errors by the order a sequential check would have found them
+static int compare_errors(const void *a, const void *b)
+{
+    const struct fcheck_error *x = a, *y = b;
+
+    if (x->key != y->key)
+    {
+        return x->key < y->key ? -1 : 1;
+    }
+
+    return x < y ? -1 : x > y;
+}
+
+// helper for check_references and check_inode_blocks
+// visit the blocks queued by the inode scan in ordered mode, and empty the
+// queue; indirect blocks are read first, in disk order, adding the blocks
+// they list, then the queue is sorted again and directory blocks are read in
+// disk order
+// double-indirect blocks get a pass of their own before the indirect blocks,
+// since the indirect blocks they list are only queued as they are read
+static void visit_references(struct checker *fc)
+{
+    struct reference *reference;
+    long i, count;
+    int pass;
+
+    for (pass = !DOUBLE_INDIRECT; pass < 2; pass++)
+    {
+        sort_references(fc);
+
+        if (current_prefetcher != NULL)
+        {
+            current_prefetcher->next = 0;
+        }
+        count = fc->references.count;
+        for (i = 0; i < count; i++)
+        {
+            prefetch_references(fc, i, REF_INDIRECT);
+            reference = &fc->references.references[i];
+            if (reference->role == REF_INDIRECT && ((reference->flags & REF_DOUBLE) != 0) == (pass == 0))
+            {
+                check_indirect_block(fc, reference->inode, reference->block, reference->slot,
+                                     reference->flags);
+            }
+        }
+    }
+
+    sort_references(fc);
+
+    if (current_prefetcher != NULL)
+    {
+        current_prefetcher->next = 0;
+    }
+    for (i = 0; i < fc->references.count; i++)
+    {
+        prefetch_references(fc, i, REF_DIRECTORY);
+        reference = &fc->references.references[i];
+
+        if (reference->flags & REF_MARKED)
+        {
+            mark_block(fc, reference->block);
+        }
+        if ((reference->flags & REF_LISTED) || reference->role == REF_INDIRECT)
+        {
+            bitset_mark(fc, fc->accounting.block_indirect, reference->block - fc->datablocks_start);
+        }
+        if (reference->role == REF_DIRECTORY)
+        {
+            check_directory(fc, reference->inode, reference->block, reference->slot);
+        }
+    }
+
+    fc->references.count = 0;
+}
+
+// helper for check_image
+// visit the blocks still queued by the inode scan in ordered mode
+static void check_references(struct checker *fc)
+{
+    visit_references(fc);
+    free(fc->references.references);
+    memset(&fc->references, 0, sizeof(fc->references));
+
+    // report the errors in the order a sequential check finds them
+    if (fc->errors.count > 1)
+    {
+        qsort(fc->errors.records, fc->errors.count, sizeof(struct fcheck_error), compare_errors);
+    }
+    fc->defer_errors = 0;
+    if (fc->errors.count > 0 && !fc->collect_all)
+    {
+        longjmp(fc->abort, 1);
+    }
+}
+
+// helper for check_image
+// get the details of the bitmap
+// every bitmap block is copied once into a packed bitset of 64-bit words
+static void get_bitmap_info(struct checker *fc)
+{
+    int bitmap_blocks = fc->datablocks_start - fc->bitmap_start;
+    int bitmap_bytes = bitmap_blocks * BSIZE;
+
+    fc->bitmap_bits = bitmap_blocks * BPB;
+
+    // two zero words past the data blocks let check_bitmap read the words of
+    // any data block, and the one after, without a bounds check
+    long bits = fc->bitmap_bits > fc->datablocks_end ? fc->bitmap_bits : fc->datablocks_end;
+    fc->bitmap = calloc(bits / 64 + 2, sizeof(uint64_t));
+    if (fc->bitmap == NULL)
+    {
+        out_of_memory(fc);
+    }
+
+    // the bitmap blocks are contiguous, so they can be read as one run
+    // once the last of them is known to be inside the image
+    unsigned char *buf = NULL;
+    if (get_block(fc, fc->datablocks_start - 1) != NULL)
+    {
+        buf = (unsigned char *)image_at(fc, (off_t)fc->bitmap_start * BSIZE, bitmap_bytes);
+    }
+
+    int i;
+    for (i = 0; buf != NULL && i < bitmap_bytes; i++)
+    {
+        fc->bitmap[i / 8] |= (uint64_t)buf[i] << ((i % 8) * 8);
+    }
+    if (buf != NULL)
+    {
+        COUNT(fc, blocks_read, bitmap_blocks);
+        COUNT(fc, bytes_touched, bitmap_bytes);
+    }
+}
+
+// helper for check_inodes
+// record the details of the given inode
+// the link count is added rather than assigned because directories earlier
+// in the inode table may already have referenced this inode
+static void get_inode_info(struct checker *fc, struct dinode *inode, int inode_number)
+{
+    switch(inode->type) {
+        case T_FILE:
+            count_references(fc, inode_number, inode->nlink);
+            bitset_mark(fc, fc->accounting.inode_allocated, inode_number);
+            break;
+        case T_DIR:
+        case T_DEV:
+            bitset_mark(fc, fc->accounting.inode_allocated, inode_number);
+        default:
+            break;
+    }
+}
+
+// helper for check_inode_blocks
+// add what an unchanged inode block's inodes added on the last clean check,
+// without reading the blocks they point to; the bitmap and the inodes named
+// are looked at as they are now
+static void replay_facts(struct checker *fc, struct block_facts *facts)
+{
+    uint i;
+
+    for (i = 0; i < facts->uses.count; i++)
+    {
+        int block = facts->uses.facts[i] & ~USE_INDIRECT;
+
+        if (facts->uses.facts[i] & USE_INDIRECT)
+        {
+            bitset_mark(fc, fc->accounting.block_indirect, block - fc->datablocks_start);
+        }
+        if (check_block(fc, NONE, block))
+        {
+            mark_block(fc, block);
+        }
+    }
+
+    for (i = 0; i < facts->names.count; i++)
+    {
+        int inode_number = facts->names.facts[i] & ~NAME_DOT;
+
+        if (check_type(fc, inode_number, facts->names.facts[i] & NAME_DOT ? "." : "", NONE) &&
+            inode_number != 0)
+        {
+            mark_inode(fc, inode_number);
+        }
+    }
+}
+
+// helper for check_inodes
+// check every inode stored in the given range of inode blocks
+// with the cache option, the facts of an unchanged block are added from
+// the cache, and those of a changed one are noted as it is checked
+static void check_inode_blocks(struct checker *fc, int first_block, int last_block)
+{
+    struct dinode *inode_block, *inode;
+    struct block_facts *facts = NULL;
+    int block, i, inode_number;
+
+    for (block = first_block; block <= last_block; block++)
+    {
+        // stop early once an earlier worker has found the first error
+        if (current_worker != NULL &&
+            __atomic_load_n(&fc->failed_worker, __ATOMIC_RELAXED) < current_worker->index)
+        {
+            return;
+        }
+
+        if (!fc->ordered)
+        {
+            prefetch_inodes(fc, block, last_block);
+        }
+
+        inode_block = (struct dinode *)get_block(fc, block);
+
+        if (inode_block == NULL)
+        {
+            return;
+        }
+
+        if (fc->cache.blocks != NULL)
+        {
+            facts = &fc->cache.blocks[block - IBLOCK(0)];
+            current_facts = facts->changed ? facts : NULL;
+        }
+
+        for (i = 0; i < IPB; i++)
+        {
+            inode_number = (block - IBLOCK(0)) * IPB + i;
+            if (inode_number == 0)
+            {
+                continue;
+            }
+            else if (inode_number >= fc->superblock.ninodes)
+            {
+                break;
+            }
+
+            inode = inode_block + i;
+            error_key = ERROR_KEY(inode_number, INODE_SLOT, 0);
+
+            get_inode_info(fc, inode, inode_number);
+
+            if (facts != NULL && !facts->changed)
+            {
+                continue;
+            }
+
+            if (inode->type < 0 || inode->type > 3)
+            {
+                // the pointers of an inode with a bad type mean nothing
+                fail(fc, FCHECK_BAD_INODE, inode_number, block);
+                continue;
+            }
+            else if (inode_number == 1) // should be root directory
+            {
+                if (inode->type != T_DIR)
+                {
+                    fail(fc, FCHECK_NO_ROOT_DIRECTORY, inode_number, NONE);
+                }
+            }
+
+            check_direct_pointers(fc, inode, inode_number);
+
+            check_indirect_pointers(fc, inode, inode_number);
+        }
+
+        if (facts != NULL && !facts->changed)
+        {
+            replay_facts(fc, facts);
+        }
+        current_facts = NULL;
+
+        // with --mem a full queue is visited between inode blocks, so no
+        // pointer into the inode table is held while the windows move
+        if (fc->queue_limit > 0 && fc->references.count >= fc->queue_limit)
+        {
+            visit_references(fc);
+        }
+    }
+}
+
+// helper for check_inodes_worker
+// record when a worker stops, also when an error ends it early
+static void stop_worker(void *arg)
+{
+    struct worker *worker = (struct worker *)arg;
+
+    stop_prefetch(worker->checker);
+    if (worker->checker->stats)
+    {
+        worker->stats.seconds = now() - worker->checker->started - worker->stats.start;
+    }
+}
+
+// helper for check_inodes
+// entry point of a worker thread
+static void *check_inodes_worker(void *arg)
+{
+    current_worker = (struct worker *)arg;
+    struct checker *fc = current_worker->checker;
+
+    if (fc->stats)
+    {
+        current_worker->stats.start = now() - fc->started;
+    }
+
+    pthread_cleanup_push(stop_worker, current_worker);
+    start_prefetch(fc);
+    check_inode_blocks(fc, current_worker->first_block, current_worker->last_block);
+    pthread_cleanup_pop(1);
+
+    return NULL;
+}
+
+// helper for check_image
+// make sure inodes are correct
+// the inode table is walked once, a block of IPB inodes at a time, split
+// into contiguous ranges of blocks when more than one thread is used
+static void check_inodes(struct checker *fc)
+{
+    if (fc->superblock.ninodes < 2)
+    {
+        return;
+    }
+
+    int first_block = IBLOCK(1);
+    int last_block = IBLOCK(fc->superblock.ninodes - 1);
+
+    if (fc->threads == 1)
+    {
+        check_inode_blocks(fc, first_block, last_block);
+        return;
+    }
+
+    struct worker workers[MAX_THREADS];
+    int inode_blocks = last_block - first_block + 1;
+    int count = fc->threads < inode_blocks ? fc->threads : inode_blocks;
+
+    int i, j;
+    for (i = 0; i < count; i++)
+    {
+        workers[i].checker = fc;
+        workers[i].index = i;
+        workers[i].first_block = first_block + (long)inode_blocks * i / count;
+        workers[i].last_block = first_block + (long)inode_blocks * (i + 1) / count - 1;
+        memset(&workers[i].errors, 0, sizeof(struct error_list));
+        memset(&workers[i].stats, 0, sizeof(struct fcheck_stats));
+
+        if (pthread_create(&workers[i].thread, NULL, check_inodes_worker, &workers[i]) != 0)
+        {
+            fc->problem = "thread could not be created.";
+            break;
+        }
+    }
+
+    // wait for every worker that started, even if the check is given up
+    count = i;
+    for (i = 0; i < count; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+
+        // each thread was created and joined
+        COUNT(fc, syscalls, 2);
+        if (fc->stats)
+        {
+            add_stats(&fc->counters, &workers[i].stats, 1);
+            fc->workers[i] = workers[i].stats;
+        }
+    }
+    fc->worker_count = fc->stats ? count : 0;
+
+    if (fc->problem != NULL)
+    {
+        for (i = 0; i < count; i++)
+        {
+            free(workers[i].errors.records);
+        }
+        longjmp(fc->abort, 1);
+    }
+
+    // report errors range by range, as a single thread would have found them
+    for (i = 0; i < count; i++)
+    {
+        for (j = 0; j < workers[i].errors.count; j++)
+        {
+            add_error(fc, &fc->errors, workers[i].errors.records[j]);
+        }
+        free(workers[i].errors.records);
+    }
+
+    if (fc->errors.count > 0 && !fc->collect_all)
+    {
+        longjmp(fc->abort, 1);
+    }
+}
+
+// helper for check_image
+// make sure blocks are only used once
+static void check_addresses(struct checker *fc, int i)
+{
+    if (bitset_test(fc->accounting.block_indirect, i))
+    {
+        fail(fc, FCHECK_INDIRECT_ADDRESS_REUSED, NONE, i + fc->datablocks_start);
+    }
+    else
+    {
+        fail(fc, FCHECK_DIRECT_ADDRESS_REUSED, NONE, i + fc->datablocks_start);
+    }
+}
+
+// helper for scan functions
+// the bits of the on-disk bitmap for 64 data blocks, starting at data block
+// 64 * word; bitmap and shift locate data block 0 in the bitmap
+static inline uint64_t marked_word(const uint64_t *bitmap, int shift, long word)
+{
+    if (shift == 0)
+    {
+        return bitmap[word];
+    }
+
+    return (bitmap[word] >> shift) | (bitmap[word + 1] << (64 - shift));
+}
+
+// helper for check_bitmap
+// find the first word, from first up to words, holding a data block that is
+// marked used but not used, or used more than once; returns words if none is
+typedef long (*scan_function)(const uint64_t *bitmap, int shift, const uint64_t *used,
+                              const uint64_t *reused, long first, long words);
+
+static long scan_scalar(const uint64_t *bitmap, int shift, const uint64_t *used,
+                        const uint64_t *reused, long first, long words)
+{
+    long word;
+
+    for (word = first; word < words; word++)
+    {
+        if ((marked_word(bitmap, shift, word) & ~used[word]) | reused[word])
+        {
+            return word;
+        }
+    }
+
+    return words;
+}
+
+#ifdef HAVE_X86_VECTORS
+// two words at a time
+// a shift by 64 gives 0, so a bitmap that is already aligned needs no case
+__attribute__((target("sse2")))
+static long scan_sse2(const uint64_t *bitmap, int shift, const uint64_t *used,
+                      const uint64_t *reused, long first, long words)
+{
+    __m128i right = _mm_cvtsi32_si128(shift);
+    __m128i left = _mm_cvtsi32_si128(64 - shift);
+    __m128i zero = _mm_setzero_si128();
+    long word;
+
+    for (word = first; word + 2 <= words; word += 2)
+    {
+        __m128i low = _mm_loadu_si128((const __m128i *)(bitmap + word));
+        __m128i high = _mm_loadu_si128((const __m128i *)(bitmap + word + 1));
+        __m128i marked = _mm_or_si128(_mm_srl_epi64(low, right), _mm_sll_epi64(high, left));
+        __m128i bad = _mm_or_si128(_mm_andnot_si128(_mm_loadu_si128((const __m128i *)(used + word)), marked),
+                                   _mm_loadu_si128((const __m128i *)(reused + word)));
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(bad, zero)) != 0xffff)
+        {
+            break;
+        }
+    }
+
+    return scan_scalar(bitmap, shift, used, reused, word, words);
+}
+
+// four words at a time
+__attribute__((target("avx2")))
+static long scan_avx2(const uint64_t *bitmap, int shift, const uint64_t *used,
+                      const uint64_t *reused, long first, long words)
+{
+    __m128i right = _mm_cvtsi32_si128(shift);
+    __m128i left = _mm_cvtsi32_si128(64 - shift);
+    long word;
+
+    for (word = first; word + 4 <= words; word += 4)
+    {
+        __m256i low = _mm256_loadu_si256((const __m256i *)(bitmap + word));
+        __m256i high = _mm256_loadu_si256((const __m256i *)(bitmap + word + 1));
+        __m256i marked = _mm256_or_si256(_mm256_srl_epi64(low, right), _mm256_sll_epi64(high, left));
+        __m256i bad = _mm256_or_si256(_mm256_andnot_si256(_mm256_loadu_si256((const __m256i *)(used + word)), marked),
+                                      _mm256_loadu_si256((const __m256i *)(reused + word)));
+
+        if (!_mm256_testz_si256(bad, bad))
+        {
+            break;
+        }
+    }
+
+    return scan_scalar(bitmap, shift, used, reused, word, words);
+}
+#endif
+
+// helper for check_bitmap
+// the widest scan the processor supports
+// FCHECK_SIMD=scalar, sse2 or avx2 asks for a narrower one
+static scan_function choose_scan()
+{
+    const char *wanted = getenv("FCHECK_SIMD");
+
+    if (wanted != NULL && strcmp(wanted, "scalar") == 0)
+    {
+        return scan_scalar;
+    }
+
+#ifdef HAVE_X86_VECTORS
+    __builtin_cpu_init();
+    if ((wanted == NULL || strcmp(wanted, "avx2") == 0) && __builtin_cpu_supports("avx2"))
+    {
+        return scan_avx2;
+    }
+    if (__builtin_cpu_supports("sse2"))
+    {
+        return scan_sse2;
+    }
+#endif
+
+    return scan_scalar;
+}
+
+// helper for check_image
+// make sure bitmap is correct
+// the on-disk bitmap is compared with the blocks in use a vector of words at
+// a time, and only words with a mismatch are looked at bit by bit, in block
+// order, so the first error is the one a block-by-block loop would find
+static void check_bitmap(struct checker *fc)
+{
+    scan_function scan = choose_scan();
+    const uint64_t *bitmap = fc->bitmap + fc->datablocks_start / 64;
+    int shift = fc->datablocks_start % 64;
+    const uint64_t *used = fc->accounting.block_used;
+    const uint64_t *reused = fc->accounting.block_reused;
+    long blocks = fc->superblock.nblocks;
+    long full_words = blocks / 64;
+    long word = scan(bitmap, shift, used, reused, 0, full_words);
+
+    while (word <= full_words)
+    {
+        uint64_t marked = marked_word(bitmap, shift, word);
+        uint64_t pending;
+
+        // the last word may hold fewer than 64 data blocks
+        if (word == full_words)
+        {
+            if (blocks % 64 == 0)
+            {
+                break;
+            }
+            uint64_t in_range = ((uint64_t)1 << (blocks % 64)) - 1;
+            marked &= in_range;
+            pending = ((marked & ~used[word]) | reused[word]) & in_range;
+        }
+        else
+        {
+            pending = (marked & ~used[word]) | reused[word];
+        }
+
+        while (pending != 0)
+        {
+            int i = word * 64 + __builtin_ctzll(pending);
+
+            if ((marked >> (i % 64)) & 1 && !bitset_test(fc->accounting.block_used, i))
+            {
+                fail(fc, FCHECK_BLOCK_NOT_IN_USE, NONE, i + fc->datablocks_start);
+            }
+            else
+            {
+                check_addresses(fc, i);
+            }
+            pending &= pending - 1;
+        }
+
+        word = word < full_words ? scan(bitmap, shift, used, reused, word + 1, full_words) : full_words + 1;
+    }
+}
+
+// helper for check_image
+// with --quick, make sure the superblock describes this image
+static void quick_check_geometry(struct checker *fc)
+{
+    error_key = 0;
+
+    if (fc->superblock.ninodes <= ROOTINO || fc->superblock.size != (uint)fc->datablocks_end)
+    {
+        fail(fc, FCHECK_BAD_SUPERBLOCK, NONE, 1);
+    }
+
+    if ((off_t)fc->superblock.size * BSIZE > fc->file_stat.st_size)
+    {
+        fail(fc, FCHECK_BLOCK_OUTSIDE_IMAGE, NONE, (long)fc->superblock.size - 1);
+    }
+}
+
+// helper for quick_check_inodes
+// count a data block an inode points to, if it is a data block
+// returns 1 if it is
+static int quick_count_block(struct checker *fc, uint block)
+{
+    if (block < (uint)fc->datablocks_start || block >= (uint)fc->datablocks_end)
+    {
+        return 0;
+    }
+
+    fc->blocks_in_use++;
+    return 1;
+}
+
+// helper for quick_check_inodes
+// make sure an indirect pointer, found at slot, and the pointers its block
+// lists are good, and count them; a double-indirect block lists indirect
+// blocks, which are checked in turn
+static void quick_check_indirect(struct checker *fc, int inode_number, uint indirect, int slot, int doubly)
+{
+    uint listed[NINDIRECT];
+    int i;
+
+    error_key = ERROR_KEY(inode_number, slot, 0);
+    if (indirect == 0)
+    {
+        return;
+    }
+    if (!quick_count_block(fc, indirect))
+    {
+        fail(fc, FCHECK_BAD_INDIRECT_ADDRESS, inode_number, indirect);
+        return;
+    }
+
+    uint *addrs = (uint *)get_block(fc, indirect);
+    if (addrs == NULL)
+    {
+        return;
+    }
+    COUNT(fc, indirect_blocks, 1);
+
+    // a copy, since reading the blocks it lists may move the window under --mem
+    if (DOUBLE_INDIRECT && doubly)
+    {
+        memcpy(listed, addrs, sizeof(listed));
+        addrs = listed;
+    }
+
+    for (i = 0; i < NINDIRECT; i++)
+    {
+        if (DOUBLE_INDIRECT && doubly)
+        {
+            quick_check_indirect(fc, inode_number, addrs[i], SECOND_SLOT(i), 0);
+            continue;
+        }
+
+        error_key = ERROR_KEY(inode_number, LISTED_SLOT(slot, i), 0);
+        if (addrs[i] != 0 && !quick_count_block(fc, addrs[i]))
+        {
+            fail(fc, FCHECK_BAD_INDIRECT_ADDRESS, inode_number, addrs[i]);
+        }
+    }
+}
+
+// helper for check_image
+// with --quick, make sure every inode has a good type and good addresses,
+// and count the data blocks they point to
+// no directory is read except the first block of the root
+static void quick_check_inodes(struct checker *fc)
+{
+    uint inode_number;
+    int i;
+
+    for (inode_number = ROOTINO; inode_number < fc->superblock.ninodes; inode_number++)
+    {
+        struct dinode *inode = get_inode(fc, inode_number);
+        error_key = ERROR_KEY(inode_number, INODE_SLOT, 0);
+
+        if (inode == NULL)
+        {
+            return;
+        }
+
+        if (inode->type < 0 || inode->type > 3)
+        {
+            fail(fc, FCHECK_BAD_INODE, inode_number, IBLOCK(inode_number));
+            continue;
+        }
+
+        for (i = 0; i < NDIRECT; i++)
+        {
+            error_key = ERROR_KEY(inode_number, DIRECT_SLOT(i), 0);
+            if (inode->addrs[i] != 0 && !quick_count_block(fc, inode->addrs[i]))
+            {
+                fail(fc, FCHECK_BAD_DIRECT_ADDRESS, inode_number, inode->addrs[i]);
+            }
+        }
+
+        for (i = 0; i <= DOUBLE_INDIRECT; i++)
+        {
+            quick_check_indirect(fc, inode_number, inode->addrs[NDIRECT + i],
+                                 i ? DOUBLE_SLOT : INDIRECT_SLOT, i);
+        }
+
+        // the root must be a directory whose . and .. are itself
+        if (inode_number == ROOTINO)
+        {
+            error_key = ERROR_KEY(inode_number, DIRECT_SLOT(0), 1);
+            struct dirent *entries = NULL;
+
+            if (inode->type == T_DIR && inode->addrs[0] >= (uint)fc->datablocks_start &&
+                inode->addrs[0] < (uint)fc->datablocks_end)
+            {
+                entries = (struct dirent *)get_block(fc, inode->addrs[0]);
+                COUNT(fc, directory_blocks, entries != NULL);
+            }
+
+            if (entries == NULL || entries[0].inum != ROOTINO || entries[1].inum != ROOTINO)
+            {
+                fail(fc, FCHECK_NO_ROOT_DIRECTORY, ROOTINO, NONE);
+            }
+        }
+    }
+}
+
+// helper for check_image
+// with --quick, make sure the bitmap marks as many data blocks used as the
+// inodes point to
+static void quick_check_bitmap(struct checker *fc)
+{
+    const uint64_t *bitmap = fc->bitmap + fc->datablocks_start / 64;
+    int shift = fc->datablocks_start % 64;
+    long blocks = fc->superblock.nblocks;
+    long marked = 0;
+    long word;
+
+    for (word = 0; word < blocks / 64; word++)
+    {
+        marked += __builtin_popcountll(marked_word(bitmap, shift, word));
+    }
+    if (blocks % 64 != 0)
+    {
+        marked += __builtin_popcountll(marked_word(bitmap, shift, word) &
+                                       (((uint64_t)1 << (blocks % 64)) - 1));
+    }
+
+    error_key = UINT64_MAX;
+    if (marked != fc->blocks_in_use)
+    {
+        fail(fc, FCHECK_BITMAP_COUNT, NONE, NONE);
+    }
+}
+
+// helper for check_image
+// make sure all inodes are referred to in some directory
+static void check_directories(struct checker *fc)
+{
+    uint i;
+    for (i = 0; i < fc->superblock.ninodes; i++)
+    {
+        if (bitset_test(fc->accounting.directory_relinked, i))
+        {
+            fail(fc, FCHECK_DIRECTORY_REUSED, i, NONE);
+        }
+        else if (bitset_test(fc->accounting.inode_allocated, i) &&
+                 !bitset_test(fc->accounting.inode_referenced, i))
+        {
+            fail(fc, FCHECK_INODE_NOT_IN_DIRECTORY, i, NONE);
+        }
+        else if (fc->accounting.reference_count[i] != 0)
+        {
+            fail(fc, FCHECK_BAD_REFERENCE_COUNT, i, NONE);
+        }
+    }
+}
+
+// helper for the walk
+// a data block inside the image, or NULL
+// unlike get_block nothing is reported, so the walk can run on any image
+static char *peek_block(struct checker *fc, uint block)
+{
+    if (block < (uint)fc->datablocks_start || block >= (uint)fc->datablocks_end ||
+        (off_t)(block + 1) * BSIZE > fc->file_stat.st_size)
+    {
+        return NULL;
+    }
+
+    COUNT(fc, blocks_read, 1);
+    COUNT(fc, bytes_touched, BSIZE);
+    return image_at(fc, (off_t)block * BSIZE, BSIZE);
+}
+
+// helper for the walk
+// an inode inside the image, or NULL
+static struct dinode *peek_inode(struct checker *fc, uint inode_number)
+{
+    if (inode_number == 0 || inode_number >= fc->superblock.ninodes ||
+        (off_t)(IBLOCK(inode_number) + 1) * BSIZE > fc->file_stat.st_size)
+    {
+        return NULL;
+    }
+
+    return (struct dinode *)image_at(fc, (off_t)IBLOCK(inode_number) * BSIZE, BSIZE) +
+           inode_number % IPB;
+}
+
+// helper for the name index
+// FNV-1a over a directory and the first length bytes of a name
+static uint hash_name(uint directory, const char *name, size_t length)
+{
+    uint64_t hash = (14695981039346656037ULL ^ directory) * 1099511628211ULL;
+    size_t i;
+
+    for (i = 0; i < length; i++)
+    {
+        hash = (hash ^ (unsigned char)name[i]) * 1099511628211ULL;
+    }
+
+    return (uint)(hash ^ hash >> 32);
+}
+
+// helper for the name index
+// put a name in the first free slot from its hash
+static void place_name(struct fcheck_index *index, uint name_number)
+{
+    struct name *name = &index->names[name_number];
+    uint slot = hash_name(name->directory, name->name, strnlen(name->name, DIRSIZ));
+
+    while (index->slots[slot & index->slot_mask] != 0)
+    {
+        slot++;
+    }
+    index->slots[slot & index->slot_mask] = name_number + 1;
+}
+
+#ifdef DEFAULT_GEOMETRY
+
+// helper for the name index
+// the first name in a directory that matches, + 1, or 0
+static uint find_name(const struct fcheck_index *index, uint directory, const char *name,
+                      size_t length)
+{
+    uint slot = hash_name(directory, name, length);
+    uint found;
+
+    while ((found = index->slots[slot & index->slot_mask]) != 0)
+    {
+        const struct name *candidate = &index->names[found - 1];
+        if (candidate->directory == directory && strnlen(candidate->name, DIRSIZ) == length &&
+            memcmp(candidate->name, name, length) == 0)
+        {
+            return found;
+        }
+        slot++;
+    }
+
+    return 0;
+}
+
+#endif
+
+// helper for walk
+// an empty name index for every inode of the image
+static void create_index(struct checker *fc)
+{
+    struct fcheck_index *index = calloc(1, sizeof(struct fcheck_index));
+
+    if (index == NULL)
+    {
+        out_of_memory(fc);
+    }
+    fc->index = index;
+    index->ninodes = fc->superblock.ninodes;
+    index->capacity = 256;
+    index->slot_mask = 2 * index->capacity - 1;
+    index->names = malloc(index->capacity * sizeof(struct name));
+    index->slots = calloc(index->slot_mask + 1, sizeof(uint));
+    index->first = calloc(index->ninodes, sizeof(uint));
+    index->last = calloc(index->ninodes, sizeof(uint));
+    if (index->names == NULL || index->slots == NULL || index->first == NULL || index->last == NULL)
+    {
+        out_of_memory(fc);
+    }
+}
+
+// frees an index, which may be partly built
+static void free_index(struct fcheck_index *index)
+{
+    if (index != NULL)
+    {
+        free(index->names);
+        free(index->slots);
+        free(index->first);
+        free(index->last);
+        free(index);
+    }
+}
+
+// helper for walk_directory
+// add a name the walk found to the index, keeping the slots at most half full
+static void index_name(struct checker *fc, uint directory, uint inode_number, const char *name)
+{
+    struct fcheck_index *index = fc->index;
+    uint i;
+
+    if (index->count == index->capacity)
+    {
+        struct name *names = realloc(index->names, 2 * index->capacity * sizeof(struct name));
+        uint *slots = calloc(4 * index->capacity, sizeof(uint));
+        if (names == NULL || slots == NULL)
+        {
+            free(slots);
+            index->names = names != NULL ? names : index->names;
+            out_of_memory(fc);
+        }
+
+        index->names = names;
+        index->capacity *= 2;
+        free(index->slots);
+        index->slots = slots;
+        index->slot_mask = 2 * index->capacity - 1;
+        for (i = 0; i < index->count; i++)
+        {
+            place_name(index, i);
+        }
+    }
+
+    struct name *added = &index->names[index->count];
+    added->directory = directory;
+    added->inode = inode_number;
+    added->next = 0;
+    memcpy(added->name, name, DIRSIZ);
+    place_name(index, index->count++);
+
+    if (index->last[inode_number] != 0)
+    {
+        index->names[index->last[inode_number] - 1].next = index->count;
+    }
+    else
+    {
+        index->first[inode_number] = index->count;
+    }
+    index->last[inode_number] = index->count;
+}
+
+// helper for walk_directory
+// returns 1 if the walk reached directory through ancestor
+static int is_ancestor(struct checker *fc, uint ancestor, uint directory)
+{
+    uint steps;
+
+    for (steps = 0; steps < fc->superblock.ninodes && directory != 0; steps++)
+    {
+        if (directory == ancestor)
+        {
+            return 1;
+        }
+        if (fc->links[directory].parent == directory)
+        {
+            return 0;
+        }
+        directory = fc->links[directory].parent;
+    }
+
+    return 0;
+}
+
+// helper for walk_directory
+// copy the list in an indirect block, or return 0 if it cannot be read
+// a copy, since reading the blocks it lists may move the windows under --mem
+static int peek_list(struct checker *fc, uint indirect, uint *listed)
+{
+    uint *addrs = indirect ? (uint *)peek_block(fc, indirect) : NULL;
+
+    if (addrs == NULL)
+    {
+        return 0;
+    }
+    memcpy(listed, addrs, NINDIRECT * sizeof(uint));
+
+    return 1;
+}
+
+// helper for walk
+// read every block of a directory once, remember where each inode in it was
+// found, and push the directories in it the walk has not reached yet
+static void walk_directory(struct checker *fc, uint directory, int report)
+{
+    // copies, since reading the entries may move the windows under --mem
+    struct dinode inode = *peek_inode(fc, directory);
+    uint listed[NINDIRECT];
+    uint second[DOUBLE_INDIRECT ? NINDIRECT : 1] = { 0 };
+    int indirect = peek_list(fc, inode.addrs[NDIRECT], listed);
+    int doubly = DOUBLE_INDIRECT && peek_list(fc, inode.addrs[NDIRECT + DOUBLE_INDIRECT], second);
+    long i, blocks = NDIRECT + (indirect ? NINDIRECT : 0);
+    int entry;
+
+    // the blocks listed under a double-indirect block come last
+    for (i = 0; i < blocks + (doubly ? NINDIRECT * NINDIRECT : 0); i++)
+    {
+        uint block;
+
+        if (i < NDIRECT)
+        {
+            block = inode.addrs[i];
+        }
+        else if (i < blocks)
+        {
+            block = listed[i - NDIRECT];
+        }
+        else
+        {
+            // move to the next indirect block each time its list is done
+            long j = i - blocks;
+            if (j % NINDIRECT == 0 && !peek_list(fc, second[j / NINDIRECT], listed))
+            {
+                i += NINDIRECT - 1;
+                continue;
+            }
+            block = listed[j % NINDIRECT];
+        }
+
+        struct dirent *entries = (struct dirent *)peek_block(fc, block);
+
+        if (entries == NULL)
+        {
+            continue;
+        }
+        COUNT(fc, directory_blocks, 1);
+
+        for (entry = 0; entry < ENTRIES; entry++)
+        {
+            uint inode_number = entries[entry].inum;
+            struct dinode *child = peek_inode(fc, inode_number);
+
+            if (child == NULL || strncmp(entries[entry].name, ".", DIRSIZ) == 0)
+            {
+                continue;
+            }
+
+            // .. must lead back the way the walk came
+            if (strncmp(entries[entry].name, "..", DIRSIZ) == 0)
+            {
+                uint parent = fc->links[directory].parent;
+                if (report && (parent != directory || directory == ROOTINO) && inode_number != parent)
+                {
+                    fail(fc, FCHECK_PARENT_MISMATCH, directory, block);
+                }
+                continue;
+            }
+
+            if (fc->links[inode_number].parent == 0)
+            {
+                fc->links[inode_number] = (struct link){ directory, block, entry };
+            }
+            if (fc->index != NULL)
+            {
+                index_name(fc, directory, inode_number, entries[entry].name);
+            }
+
+            if (child->type != T_DIR)
+            {
+                continue;
+            }
+
+            if (!bitset_test(fc->walked, inode_number))
+            {
+                bitset_mark(fc, fc->walked, inode_number);
+                if (fc->stack.count == fc->stack.capacity)
+                {
+                    int capacity = fc->stack.capacity ? fc->stack.capacity * 2 : 256;
+                    uint *directories = realloc(fc->stack.directories, capacity * sizeof(uint));
+                    if (directories == NULL)
+                    {
+                        out_of_memory(fc);
+                    }
+                    fc->stack.directories = directories;
+                    fc->stack.capacity = capacity;
+                }
+                fc->stack.directories[fc->stack.count++] = inode_number;
+            }
+            else if (report && is_ancestor(fc, inode_number, directory))
+            {
+                fail(fc, FCHECK_DIRECTORY_CYCLE, inode_number, block);
+            }
+        }
+    }
+}
+
+// helper for walk
+// walk every directory below the given one, depth first from a stack of
+// directories, so deep trees need no recursion
+static void walk_from(struct checker *fc, uint directory, int report)
+{
+    bitset_mark(fc, fc->walked, directory);
+    fc->stack.directories[fc->stack.count++] = directory;
+
+    while (fc->stack.count > 0)
+    {
+        walk_directory(fc, fc->stack.directories[--fc->stack.count], report);
+    }
+}
+
+// walk the tree from the root, then each part of it the root cannot reach
+// every directory block is read once; with report set, unreachable
+// directories, .. entries that lead elsewhere and directories that contain
+// an ancestor are errors
+static void walk(struct checker *fc, int report)
+{
+    uint ninodes = fc->superblock.ninodes;
+    uint i;
+
+    fc->links = calloc(ninodes, sizeof(struct link));
+    fc->walked = calloc((ninodes + 63) / 64, sizeof(uint64_t));
+    fc->stack.capacity = 256;
+    fc->stack.directories = malloc(fc->stack.capacity * sizeof(uint));
+    if (fc->links == NULL || fc->walked == NULL || fc->stack.directories == NULL)
+    {
+        out_of_memory(fc);
+    }
+    if (fc->keep_index)
+    {
+        create_index(fc);
+    }
+
+    struct dinode *root = peek_inode(fc, ROOTINO);
+    if (root == NULL || root->type != T_DIR)
+    {
+        // without a root every directory would be unreachable
+        report = 0;
+    }
+    else
+    {
+        fc->links[ROOTINO].parent = ROOTINO;
+        walk_from(fc, ROOTINO, report);
+    }
+
+    for (i = ROOTINO + 1; i < ninodes; i++)
+    {
+        struct dinode *inode = peek_inode(fc, i);
+
+        if (inode != NULL && inode->type == T_DIR && !bitset_test(fc->walked, i))
+        {
+            if (report)
+            {
+                fail(fc, FCHECK_DIRECTORY_UNREACHABLE, i, NONE);
+            }
+            fc->links[i].parent = i;
+            walk_from(fc, i, report);
+        }
+    }
+}
+
+// helper for check_image
+// make sure every directory can be reached from the root
+static void check_reachability(struct checker *fc)
+{
+    error_key = UINT64_MAX;
+    walk(fc, 1);
+}
+
+// helper for inode_path
+// the name the walk first found an inode under
+static const char *link_name(struct checker *fc, uint inode_number)
+{
+    struct link *link = &fc->links[inode_number];
+
+    return ((struct dirent *)peek_block(fc, link->block))[link->entry].name;
+}
+
+// helper for name_errors
+// the path of an inode the walk found, or NULL
+// an inode the root cannot reach is named from the top of its own tree
+static char *inode_path(struct checker *fc, long inode_number)
+{
+    uint ninodes = fc->superblock.ninodes;
+    size_t length = 0;
+    uint current, steps;
+
+    if (inode_number == ROOTINO)
+    {
+        return strdup("/");
+    }
+    if (inode_number <= 0 || inode_number >= ninodes || fc->links[inode_number].parent == 0)
+    {
+        return NULL;
+    }
+
+    // first find the length and the top of the tree, then fill the path in
+    // from its end
+    for (current = inode_number, steps = 0;
+         fc->links[current].parent != current && steps < ninodes; steps++)
+    {
+        length += 1 + strnlen(link_name(fc, current), DIRSIZ);
+        current = fc->links[current].parent;
+    }
+
+    char top[32] = "";
+    if (current != ROOTINO)
+    {
+        snprintf(top, sizeof(top), "(inode %u)", current);
+    }
+
+    size_t top_length = strlen(top);
+    char *path = malloc(top_length + length + 1);
+    if (path == NULL)
+    {
+        return NULL;
+    }
+
+    memcpy(path, top, top_length);
+    char *end = path + top_length + length;
+    *end = '\0';
+    for (current = inode_number; end > path + top_length; current = fc->links[current].parent)
+    {
+        const char *name = link_name(fc, current);
+        size_t name_length = strnlen(name, DIRSIZ);
+
+        end -= name_length;
+        memcpy(end, name, name_length);
+        *--end = '/';
+    }
+
+    return path;
+}
+
+// helper for check_image
+// name where each bad inode is, from the walk
+static void name_errors(struct checker *fc)
+{
+    int i;
+
+    for (i = 0; i < fc->errors.count; i++)
+    {
+        struct fcheck_error *record = &fc->errors.records[i];
+        if (record->inode != NONE && record->path == NULL)
+        {
+            record->path = inode_path(fc, record->inode);
+        }
+    }
+}
+
+// helper for spill_image and write_repairs
+// write all of a buffer, or return -1
+static int write_all(int fd, const void *bytes, size_t length)
+{
+    const char *next = bytes;
+
+    while (length > 0)
+    {
+        ssize_t written = write(fd, next, length);
+        if (written < 0)
+        {
+            return -1;
+        }
+        next += written;
+        length -= written;
+    }
+
+    return 0;
+}
+
+// helper for init
+// copy an image that cannot be seeked, such as a pipe from a decompressor, to
+// an unlinked temporary file, which is then checked in its place
+static void spill_image(struct checker *fc)
+{
+    const char *directory = getenv("TMPDIR");
+    char path[PATH_MAX];
+    size_t chunk = 1 << 20;
+    char *buffer = malloc(chunk);
+    ssize_t got = 0;
+
+    if (buffer == NULL)
+    {
+        out_of_memory(fc);
+    }
+
+    snprintf(path, sizeof(path), "%s/fcheck-XXXXXX", directory != NULL ? directory : "/tmp");
+    COUNT(fc, syscalls, 2);
+    int spill = mkstemp(path);
+    if (spill < 0)
+    {
+        free(buffer);
+        give_up(fc, "image could not be spilled.");
+    }
+    unlink(path);
+
+    do
+    {
+        COUNT(fc, syscalls, 2);
+        got = read(fc->fsfd, buffer, chunk);
+    } while (got > 0 && write_all(spill, buffer, got) == 0);
+    free(buffer);
+
+    if (got != 0)
+    {
+        close(spill);
+        give_up(fc, "image could not be spilled.");
+    }
+
+    if (fc->close_image)
+    {
+        close(fc->fsfd);
+    }
+    fc->fsfd = spill;
+    fc->close_image = 1;
+    fc->spilled = 1;
+}
+
+// helper for check_image
+// open and map the image, unless it was given as a buffer or is already open
+static void open_image(struct checker *fc)
+{
+    if (fc->opened)
+    {
+        return;
+    }
+    fc->opened = 1;
+
+    if (fc->mem_map_image == NULL)
+    {
+        // open file system image for reading
+        if (fc->image_path != NULL)
+        {
+            COUNT(fc, syscalls, 1);
+            if ((fc->fsfd = open(fc->image_path, fc->repair ? O_RDWR : O_RDONLY)) < 0)
+            {
+                give_up(fc, errno == ENOENT || !fc->repair ? "image not found."
+                                                           : "image could not be opened for writing.");
+            }
+            fc->close_image = 1;
+        }
+
+        // the first pass over an image that cannot be seeked copies it
+        COUNT(fc, syscalls, 1);
+        if (lseek(fc->fsfd, 0, SEEK_CUR) < 0 && errno == ESPIPE)
+        {
+            spill_image(fc);
+        }
+
+        // get file stat
+        COUNT(fc, syscalls, 1);
+        if (fstat(fc->fsfd, &fc->file_stat) < 0)
+        {
+            give_up(fc, "image could not be read.");
+        }
+
+        // with --mem a quarter of the memory goes to each window, and a
+        // quarter to the queue of blocks waiting to be visited
+        if (fc->memory > 0)
+        {
+            long page = sysconf(_SC_PAGESIZE);
+            fc->window_size = fc->memory / 4 / page * page;
+            if (fc->window_size < 16 * (size_t)page)
+            {
+                fc->window_size = 16 * page;
+            }
+            fc->queue_limit = fc->memory / 4 / sizeof(struct reference);
+            if (fc->queue_limit < 1024)
+            {
+                fc->queue_limit = 1024;
+            }
+            fc->windowed = 1;
+        }
+        else
+        {
+            // Map memory
+            COUNT(fc, syscalls, 1);
+            fc->mem_map_image = mmap(NULL, fc->file_stat.st_size, PROT_READ, MAP_PRIVATE, fc->fsfd, 0);
+            if (fc->mem_map_image == MAP_FAILED)
+            {
+                fc->mem_map_image = NULL;
+                give_up(fc, "image could not be mapped.");
+            }
+            fc->unmap_image = 1;
+        }
+    }
+}
+
+// helper for check_image
+// read the superblock, lay the image out from it and allocate memory
+static void init(struct checker *fc)
+{
+    struct superblock *sb = (struct superblock *)get_block(fc, 1);
+    if (sb == NULL)
+    {
+        longjmp(fc->abort, 1);
+    }
+    fc->superblock = *sb;
+
+    // First bitmap block number
+    uint64_t bitmap_start = 3 + (uint64_t)fc->superblock.ninodes / IPB;
+    // First data block number
+    // as in mkfs, the bitmap has a bit for every block of the image
+    uint64_t datablocks_start = bitmap_start + fc->superblock.size / BPB + 1;
+    // Last data block number
+    uint64_t datablocks_end = datablocks_start + fc->superblock.nblocks;
+
+    // everything below is sized from the superblock, so a superblock that
+    // lays out more than the image holds ends the check, even with --all
+    uint64_t image_blocks = fc->file_stat.st_size / BSIZE;
+    if (fc->superblock.size > image_blocks || datablocks_end > image_blocks)
+    {
+        error_key = 0;
+        fail(fc, FCHECK_BAD_SUPERBLOCK, NONE, 1);
+        longjmp(fc->abort, 1);
+    }
+    fc->bitmap_start = bitmap_start;
+    fc->datablocks_start = datablocks_start;
+    fc->datablocks_end = datablocks_end;
+
+    // one allocation holds every bitset, followed by the reference counts
+    size_t block_words = (fc->superblock.nblocks + 63) / 64;
+    size_t inode_words = (fc->superblock.ninodes + 63) / 64;
+    uint64_t *words = calloc(3 * block_words + 4 * inode_words +
+                             (fc->superblock.ninodes * sizeof(short) + 7) / 8, sizeof(uint64_t));
+    if (words == NULL)
+    {
+        out_of_memory(fc);
+    }
+
+    fc->accounting.block_used = words;
+    fc->accounting.block_reused = fc->accounting.block_used + block_words;
+    fc->accounting.block_indirect = fc->accounting.block_reused + block_words;
+    fc->accounting.inode_allocated = fc->accounting.block_indirect + block_words;
+    fc->accounting.inode_referenced = fc->accounting.inode_allocated + inode_words;
+    fc->accounting.directory_linked = fc->accounting.inode_referenced + inode_words;
+    fc->accounting.directory_relinked = fc->accounting.directory_linked + inode_words;
+    fc->accounting.reference_count = (short *)(fc->accounting.directory_relinked + inode_words);
+    fc->laid_out = 1;
+}
+
+// helper for the cache
+// a fast hash of some bytes, carried on from h; not meant to resist an
+// attacker, only to tell whether a block has changed
+static uint64_t hash_bytes(uint64_t h, const void *bytes, size_t length)
+{
+    const unsigned char *next = bytes;
+    uint64_t word;
+
+    for (; length >= 8; next += 8, length -= 8)
+    {
+        memcpy(&word, next, 8);
+        h = (h ^ word) * 0x9e3779b97f4a7c15;
+        h ^= h >> 29;
+    }
+    for (; length > 0; next++, length--)
+    {
+        h = (h ^ *next) * 0x100000001b3;
+    }
+
+    return h;
+}
+
+// helper for digest_inode_block
+// hash a data block, and with depth, the blocks it lists down that many levels
+static uint64_t digest_block(struct checker *fc, uint64_t h, uint block, int depth)
+{
+    uint *listed = (uint *)peek_block(fc, block);
+    int i;
+
+    if (listed == NULL)
+    {
+        return h;
+    }
+
+    h = hash_bytes(h, listed, BSIZE);
+    for (i = 0; depth > 0 && i < NINDIRECT; i++)
+    {
+        h = digest_block(fc, h, listed[i], depth - 1);
+    }
+
+    return h;
+}
+
+// helper for compare_digests
+// hash an inode block and every block check_inode_blocks reads through it:
+// the directory blocks of its directories, and every indirect block
+static uint64_t digest_inode_block(struct checker *fc, int block, int *has_directory)
+{
+    struct dinode *inodes = (struct dinode *)image_at(fc, (off_t)block * BSIZE, BSIZE);
+    uint64_t h = hash_bytes(0xcbf29ce484222325, inodes, BSIZE);
+    int i, j;
+
+    *has_directory = 0;
+    for (i = 0; i < IPB; i++)
+    {
+        long inode_number = (long)(block - IBLOCK(0)) * IPB + i;
+        struct dinode *inode = &inodes[i];
+        int directory = inode->type == T_DIR;
+
+        if (inode_number == 0 || inode_number >= fc->superblock.ninodes ||
+            inode->type < 0 || inode->type > 3)
+        {
+            continue;
+        }
+
+        *has_directory |= directory;
+        for (j = 0; directory && j < NDIRECT; j++)
+        {
+            h = digest_block(fc, h, inode->addrs[j], 0);
+        }
+        for (j = 0; j <= DOUBLE_INDIRECT; j++)
+        {
+            h = digest_block(fc, h, inode->addrs[NDIRECT + j], j + directory);
+        }
+    }
+
+    return h;
+}
+
+// helper for compare_digests
+// fill in a cache header for the image being checked
+static void describe_image(struct checker *fc, struct cache_header *header)
+{
+    memset(header, 0, sizeof(*header));
+    memcpy(header->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    header->block_size = BSIZE;
+    header->double_indirect = DOUBLE_INDIRECT;
+    header->superblock = fc->superblock;
+    header->inode_blocks = fc->cache.count;
+    header->image_size = fc->file_stat.st_size;
+    header->bitmap_digest = fc->cache.bitmap_digest;
+}
+
+// helper for load_cache
+// read a list of facts from a cache file
+// returns 0, or -1 if the file ends first
+static int load_facts(struct checker *fc, struct fact_list *list, uint count, FILE *cache)
+{
+    list->facts = malloc((count > 0 ? count : 1) * sizeof(uint));
+    if (list->facts == NULL)
+    {
+        out_of_memory(fc);
+    }
+    list->capacity = count > 0 ? count : 1;
+    list->count = fread(list->facts, sizeof(uint), count, cache);
+
+    return list->count == count ? 0 : -1;
+}
+
+// helper for compare_digests
+// read the digests and facts of the last clean check of this image
+// returns 1, or 0 if there is no cache or it is of another image
+static int load_cache(struct checker *fc)
+{
+    struct cache_header header, expected;
+    struct cache_record record;
+    long i;
+    int complete = 1;
+
+    COUNT(fc, syscalls, 1);
+    FILE *cache = fopen(fc->cache_path, "r");
+    if (cache == NULL)
+    {
+        return 0;
+    }
+
+    describe_image(fc, &expected);
+    if (fread(&header, sizeof(header), 1, cache) != 1)
+    {
+        complete = 0;
+    }
+    expected.bitmap_digest = header.bitmap_digest;
+    if (complete && memcmp(&header, &expected, sizeof(header)) != 0)
+    {
+        complete = 0;
+    }
+
+    for (i = 0; complete && i < fc->cache.count; i++)
+    {
+        struct block_facts *facts = &fc->cache.blocks[i];
+
+        if (fread(&record, sizeof(record), 1, cache) != 1)
+        {
+            complete = 0;
+            break;
+        }
+        facts->digest = record.digest;
+        facts->has_directory = record.has_directory;
+        if (load_facts(fc, &facts->uses, record.use_count, cache) < 0 ||
+            load_facts(fc, &facts->names, record.name_count, cache) < 0)
+        {
+            complete = 0;
+        }
+    }
+    fclose(cache);
+
+    if (complete)
+    {
+        fc->cache.bitmap_digest = header.bitmap_digest;
+    }
+    return complete;
+}
+
+// helper for compare_digests and cleanup
+// forget the facts of every block
+static void free_facts(struct fact_cache *cache)
+{
+    long i;
+
+    for (i = 0; cache->blocks != NULL && i < cache->count; i++)
+    {
+        free(cache->blocks[i].uses.facts);
+        free(cache->blocks[i].names.facts);
+        memset(&cache->blocks[i], 0, sizeof(struct block_facts));
+    }
+}
+
+// helper for check_image
+// with the cache option, read the cache, then hash the bitmap and every
+// inode block with the blocks read through it; a block whose digest is the
+// cache's keeps its facts, and any other is checked as usual
+// returns 1 if nothing the check reads has changed since the last clean
+// check, so that this one is clean too
+static int compare_digests(struct checker *fc)
+{
+    long i;
+
+    // an inode table that does not fit in the image is left to the check,
+    // and an image copied from a pipe could not be read again to redo it
+    if (fc->spilled || fc->superblock.ninodes < 2 ||
+        (off_t)(IBLOCK(fc->superblock.ninodes - 1) + 1) * BSIZE > fc->file_stat.st_size)
+    {
+        return 0;
+    }
+
+    fc->cache.count = IBLOCK(fc->superblock.ninodes - 1) - IBLOCK(0) + 1;
+    fc->cache.blocks = calloc(fc->cache.count, sizeof(struct block_facts));
+    if (fc->cache.blocks == NULL)
+    {
+        out_of_memory(fc);
+    }
+
+    int loaded = load_cache(fc);
+    if (!loaded)
+    {
+        free_facts(&fc->cache);
+    }
+
+    uint64_t bitmap_digest = hash_bytes(0xcbf29ce484222325, fc->bitmap, fc->bitmap_bits / 8);
+    int unchanged = loaded && bitmap_digest == fc->cache.bitmap_digest;
+    fc->cache.bitmap_digest = bitmap_digest;
+
+    for (i = 0; i < fc->cache.count; i++)
+    {
+        struct block_facts *facts = &fc->cache.blocks[i];
+        int has_directory;
+        uint64_t digest = digest_inode_block(fc, IBLOCK(0) + i, &has_directory);
+
+        if (loaded && digest == facts->digest)
+        {
+            fc->cache.replayed = 1;
+            continue;
+        }
+
+        if (!loaded || has_directory || facts->has_directory)
+        {
+            fc->cache.directories_changed = 1;
+        }
+        free(facts->uses.facts);
+        free(facts->names.facts);
+        *facts = (struct block_facts){ .digest = digest, .changed = 1, .has_directory = has_directory };
+        unchanged = 0;
+    }
+
+    return unchanged;
+}
+
+// helper for check_image
+// after a clean check with the cache option, save every block's digest and
+// facts for the next check; the cache is replaced whole, or not at all
+static void save_cache(struct checker *fc)
+{
+    struct cache_header header;
+    char path[PATH_MAX];
+    long i;
+
+    if (fc->cache.blocks == NULL || fc->problem != NULL || fc->errors.count > 0)
+    {
+        return;
+    }
+
+    snprintf(path, sizeof(path), "%s.XXXXXX", fc->cache_path);
+    COUNT(fc, syscalls, 1);
+    int descriptor = mkstemp(path);
+    FILE *cache = descriptor >= 0 ? fdopen(descriptor, "w") : NULL;
+    if (cache == NULL)
+    {
+        if (descriptor >= 0)
+        {
+            close(descriptor);
+            unlink(path);
+        }
+        return;
+    }
+
+    describe_image(fc, &header);
+    int failed = fwrite(&header, sizeof(header), 1, cache) != 1;
+    for (i = 0; !failed && i < fc->cache.count; i++)
+    {
+        struct block_facts *facts = &fc->cache.blocks[i];
+        struct cache_record record = { facts->digest, facts->has_directory,
+                                       facts->uses.count, facts->names.count };
+
+        failed = fwrite(&record, sizeof(record), 1, cache) != 1 ||
+                 fwrite(facts->uses.facts, sizeof(uint), facts->uses.count, cache) != facts->uses.count ||
+                 fwrite(facts->names.facts, sizeof(uint), facts->names.count, cache) != facts->names.count;
+    }
+
+    COUNT(fc, syscalls, 2);
+    if (fclose(cache) != 0 || failed || rename(path, fc->cache_path) < 0)
+    {
+        unlink(path);
+    }
+}
+
+// helper for plan_repairs
+// where an inode is in the image
+static off_t inode_offset(long inode_number)
+{
+    return (off_t)IBLOCK(inode_number) * BSIZE + inode_number % IPB * sizeof(struct dinode);
+}
+
+// helper for plan_repairs
+// queue bytes to be written at an offset in the image
+static void add_patch(struct checker *fc, off_t offset, const void *bytes, size_t length)
+{
+    struct patch_list *list = &fc->patches;
+
+    if (list->count == list->capacity)
+    {
+        int capacity = list->capacity ? list->capacity * 2 : 64;
+        struct patch *patches = realloc(list->patches, capacity * sizeof(struct patch));
+        if (patches == NULL)
+        {
+            out_of_memory(fc);
+        }
+        list->patches = patches;
+        list->capacity = capacity;
+    }
+
+    struct patch *patch = &list->patches[list->count];
+    if ((patch->bytes = malloc(length)) == NULL)
+    {
+        out_of_memory(fc);
+    }
+    memcpy(patch->bytes, bytes, length);
+    patch->offset = offset;
+    patch->length = length;
+    list->count++;
+}
+
+// helper for free_inode_blocks
+// clear the bit of a data block only a freed inode used
+static void free_block(struct checker *fc, uint block, uint64_t *bitmap)
+{
+    if (block >= (uint)fc->datablocks_start && block < (uint)fc->datablocks_end &&
+        !bitset_test(fc->accounting.block_reused, block - fc->datablocks_start))
+    {
+        bitmap[block / 64] &= ~((uint64_t)1 << (block % 64));
+    }
+}
+
+// helper for plan_repairs
+// clear the bits of the data blocks only a freed inode used
+// the inode is a copy, since reading its blocks may move the windows
+static void free_inode_blocks(struct checker *fc, struct dinode inode, uint64_t *bitmap)
+{
+    uint listed[NINDIRECT];
+    uint second[DOUBLE_INDIRECT ? NINDIRECT : 1];
+    int i, j;
+
+    for (i = 0; i <= NDIRECT + DOUBLE_INDIRECT; i++)
+    {
+        free_block(fc, inode.addrs[i], bitmap);
+    }
+    if (peek_list(fc, inode.addrs[NDIRECT], listed))
+    {
+        for (i = 0; i < NINDIRECT; i++)
+        {
+            free_block(fc, listed[i], bitmap);
+        }
+    }
+    if (DOUBLE_INDIRECT && peek_list(fc, inode.addrs[NDIRECT + DOUBLE_INDIRECT], second))
+    {
+        for (i = 0; i < NINDIRECT; i++)
+        {
+            free_block(fc, second[i], bitmap);
+            if (!peek_list(fc, second[i], listed))
+            {
+                continue;
+            }
+            for (j = 0; j < NINDIRECT; j++)
+            {
+                free_block(fc, listed[j], bitmap);
+            }
+        }
+    }
+}
+
+// helper for check_image
+// turn the errors that have one right fix into writes to the image
+// the bitmap is fixed in a copy, and only the bytes that changed are written;
+// an inode's nlink becomes the number of names found, and an inode no
+// directory names is freed along with the blocks only it used
+// nothing is repaired if an inode was rejected or a directory could not be
+// read, since then the counts the fixes come from are incomplete
+static void plan_repairs(struct checker *fc)
+{
+    uint64_t *bitmap = NULL;
+    size_t bitmap_words = 0;
+    int bitmap_readable = (off_t)fc->datablocks_start * BSIZE <= fc->file_stat.st_size;
+    int i;
+
+    for (i = 0; i < fc->errors.count; i++)
+    {
+        switch (fc->errors.records[i].error)
+        {
+            case FCHECK_BAD_INODE:
+            case FCHECK_BAD_DIRECT_ADDRESS:
+            case FCHECK_BAD_INDIRECT_ADDRESS:
+            case FCHECK_NO_ROOT_DIRECTORY:
+            case FCHECK_BAD_DIRECTORY_FORMAT:
+            case FCHECK_BLOCK_OUTSIDE_IMAGE:
+                return;
+        }
+    }
+
+    if (bitmap_readable)
+    {
+        long bits = fc->bitmap_bits > fc->datablocks_end ? fc->bitmap_bits : fc->datablocks_end;
+        bitmap_words = bits / 64 + 2;
+        if ((bitmap = malloc(bitmap_words * sizeof(uint64_t))) == NULL)
+        {
+            out_of_memory(fc);
+        }
+        memcpy(bitmap, fc->bitmap, bitmap_words * sizeof(uint64_t));
+    }
+
+    // inodes are freed last, so their blocks stay free whatever else is fixed
+    int pass;
+    for (pass = 0; pass < 2; pass++)
+    {
+        for (i = 0; i < fc->errors.count; i++)
+        {
+            struct fcheck_error *record = &fc->errors.records[i];
+            struct dinode *inode = record->inode != NONE ? peek_inode(fc, record->inode) : NULL;
+            uint block = record->block;
+
+            if (pass == 0 && bitmap != NULL && record->error == FCHECK_BLOCK_NOT_IN_USE &&
+                block < (uint)fc->bitmap_bits)
+            {
+                bitmap[block / 64] &= ~((uint64_t)1 << (block % 64));
+                record->repaired = 1;
+            }
+            else if (pass == 0 && bitmap != NULL && record->error == FCHECK_ADDRESS_MARKED_FREE &&
+                     block >= (uint)fc->datablocks_start && block < (uint)fc->datablocks_end &&
+                     block < (uint)fc->bitmap_bits)
+            {
+                bitmap[block / 64] |= (uint64_t)1 << (block % 64);
+                record->repaired = 1;
+            }
+            else if (pass == 0 && inode != NULL && record->error == FCHECK_BAD_REFERENCE_COUNT &&
+                     inode->type == T_FILE)
+            {
+                // a saturated count no longer says how many names there are
+                short excess = fc->accounting.reference_count[record->inode];
+                struct dinode fixed = *inode;
+
+                if (excess == SHRT_MAX || excess == SHRT_MIN || inode->nlink - excess <= 0 ||
+                    inode->nlink - excess > SHRT_MAX)
+                {
+                    continue;
+                }
+                fixed.nlink = inode->nlink - excess;
+                add_patch(fc, inode_offset(record->inode), &fixed, sizeof(fixed));
+                record->repaired = 1;
+            }
+            else if (pass == 1 && inode != NULL && record->error == FCHECK_INODE_NOT_IN_DIRECTORY &&
+                     (inode->type == T_FILE || inode->type == T_DEV) && bitmap != NULL)
+            {
+                // a directory no one names may still hold the only names of
+                // other inodes, so only files and devices are freed
+                struct dinode freed = { 0 };
+
+                free_inode_blocks(fc, *inode, bitmap);
+                add_patch(fc, inode_offset(record->inode), &freed, sizeof(freed));
+                record->repaired = 1;
+            }
+        }
+    }
+
+    // each run of changed bitmap bytes becomes one write
+    size_t byte, bytes = (size_t)(fc->datablocks_start - fc->bitmap_start) * BSIZE;
+    for (byte = 0; bitmap != NULL && byte < bytes; byte++)
+    {
+        size_t end = byte;
+        while (end < bytes && ((bitmap[end / 8] ^ fc->bitmap[end / 8]) >> (end % 8 * 8) & 0xff) != 0)
+        {
+            end++;
+        }
+        if (end > byte)
+        {
+            unsigned char run[end - byte];
+            size_t j;
+            for (j = byte; j < end; j++)
+            {
+                run[j - byte] = bitmap[j / 8] >> (j % 8 * 8);
+            }
+            add_patch(fc, (off_t)fc->bitmap_start * BSIZE + byte, run, end - byte);
+            byte = end;
+        }
+    }
+
+    free(bitmap);
+}
+
+// helper for write_repairs
+// orders patches by where they go in the image
+static int compare_patches(const void *a, const void *b)
+{
+    const struct patch *x = a, *y = b;
+
+    return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+// helper for check_image
+// write the planned repairs in one batch, in offset order
+// first the bytes they replace go to the undo log, which must not exist yet,
+// and reach the disk before the image is changed; the log also keeps the
+// image size and the bytes written, so it is only undone on this repair
+static void write_repairs(struct checker *fc)
+{
+    struct patch_list *list = &fc->patches;
+    int i;
+
+    // a buffer image belongs to the caller, and a spilled one is a copy, so
+    // either is only checked
+    if (list->count == 0 || fc->fsfd < 0 || fc->spilled)
+    {
+        for (i = 0; i < fc->errors.count; i++)
+        {
+            fc->errors.records[i].repaired = 0;
+        }
+        return;
+    }
+
+    qsort(list->patches, list->count, sizeof(struct patch), compare_patches);
+
+    if (fc->undo_log != NULL)
+    {
+        COUNT(fc, syscalls, 1);
+        int undo = open(fc->undo_log, O_WRONLY | O_CREAT | O_EXCL, 0644);
+        if (undo < 0)
+        {
+            give_up(fc, "undo log could not be created.");
+        }
+
+        // each inode is fixed once and the bitmap runs are apart, so no two
+        // patches overlap, and the bytes each writes are what the image holds
+        uint64_t size = fc->file_stat.st_size;
+        int failed = write_all(undo, UNDO_MAGIC, sizeof(UNDO_MAGIC) - 1) ||
+                     write_all(undo, &size, sizeof(size));
+        for (i = 0; i < list->count && !failed; i++)
+        {
+            struct patch *patch = &list->patches[i];
+            uint64_t header[2] = { patch->offset, patch->length };
+            failed = write_all(undo, header, sizeof(header)) ||
+                     write_all(undo, image_at(fc, patch->offset, patch->length), patch->length) ||
+                     write_all(undo, patch->bytes, patch->length);
+        }
+        COUNT(fc, syscalls, 3 + 3 * list->count);
+        failed = failed || fsync(undo) < 0;
+        close(undo);
+        // a log left behind would stop the next repair from making its own
+        if (failed)
+        {
+            unlink(fc->undo_log);
+            give_up(fc, "undo log could not be written.");
+        }
+    }
+
+    for (i = 0; i < list->count; i++)
+    {
+        struct patch *patch = &list->patches[i];
+
+        COUNT(fc, syscalls, 1);
+        if (pwrite(fc->fsfd, patch->bytes, patch->length, patch->offset) != (ssize_t)patch->length)
+        {
+            give_up(fc, "image could not be repaired.");
+        }
+    }
+    COUNT(fc, syscalls, 1);
+    if (fsync(fc->fsfd) < 0)
+    {
+        give_up(fc, "image could not be repaired.");
+    }
+}
+
+// helper for diff_images
+// pass one difference, as a line of text, to the caller
+static void report_change(struct checker *fc, const char *format, ...)
+{
+    char line[1024];
+    va_list arguments;
+
+    va_start(arguments, format);
+    vsnprintf(line, sizeof(line), format, arguments);
+    va_end(arguments);
+
+    fc->diff.visit(line, fc->diff.arg);
+}
+
+// helper for diff_superblock and diff_inode_block
+// add ", name old -> new" to a line of changes, if the values differ
+static void add_field(char *line, size_t size, const char *name, long before, long after)
+{
+    size_t length = strlen(line);
+
+    if (before != after && length < size)
+    {
+        snprintf(line + length, size - length, ", %s %ld -> %ld", name, before, after);
+    }
+}
+
+// helper for diff_images
+// a block of one of the images, or NULL if it ends first
+static char *block_of(struct checker *image, uint block)
+{
+    if ((off_t)(block + 1) * BSIZE > image->file_stat.st_size)
+    {
+        return NULL;
+    }
+
+    return image_at(image, (off_t)block * BSIZE, BSIZE);
+}
+
+// helper for diff_images
+// entry point of a thread comparing a range of blocks
+static void *compare_worker(void *arg)
+{
+    struct worker *worker = (struct worker *)arg;
+    struct checker *fc = worker->checker;
+    long word;
+
+    for (word = worker->first_block; word <= worker->last_block; word++)
+    {
+        uint64_t changed = 0;
+        long block;
+
+        for (block = word * 64; block < (word + 1) * 64 && block < fc->diff.blocks; block++)
+        {
+            if (memcmp(block_of(fc->diff.old, block), block_of(fc, block), BSIZE) != 0)
+            {
+                changed |= 1ULL << (block % 64);
+            }
+        }
+        fc->diff.changed[word] = changed;
+    }
+
+    return NULL;
+}
+
+// helper for diff_images
+// find the blocks that differ, splitting the images into contiguous ranges
+// of 64 blocks when more than one thread is used, so that each thread
+// fills in whole words of the changed bitset
+static void compare_blocks(struct checker *fc)
+{
+    struct worker workers[MAX_THREADS];
+    long words = (fc->diff.blocks + 63) / 64;
+    int count = fc->threads < words ? fc->threads : (int)words;
+    int i;
+
+    fc->diff.changed = calloc(words + 1, sizeof(uint64_t));
+    if (fc->diff.changed == NULL)
+    {
+        out_of_memory(fc);
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        workers[i].checker = fc;
+        workers[i].first_block = words * i / count;
+        workers[i].last_block = words * (i + 1) / count - 1;
+
+        // the calling thread takes the last range, and any left if a
+        // thread could not be created
+        if (i == count - 1 || pthread_create(&workers[i].thread, NULL, compare_worker, &workers[i]) != 0)
+        {
+            workers[i].last_block = words - 1;
+            compare_worker(&workers[i]);
+            break;
+        }
+        COUNT(fc, syscalls, 2);
+    }
+
+    count = i;
+    for (i = 0; i < count; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+    }
+}
+
+// helper for note_role
+// order block numbers, for bsearch
+static int compare_block_numbers(const void *a, const void *b)
+{
+    uint first = *(const uint *)a, second = *(const uint *)b;
+
+    return first < second ? -1 : first > second;
+}
+
+// helper for find_roles
+// note what a block is to an inode, if it is a changed data block
+static void note_role(struct checker *fc, struct diff_role *roles, uint block,
+                      uint inode_number, int kind)
+{
+    if (block >= (uint)fc->diff.blocks || !bitset_test(fc->diff.changed, block))
+    {
+        return;
+    }
+
+    uint *found = bsearch(&block, fc->diff.data_blocks, fc->diff.data_count, sizeof(uint),
+                          compare_block_numbers);
+    if (found != NULL)
+    {
+        roles[found - fc->diff.data_blocks] = (struct diff_role){ inode_number, kind };
+    }
+}
+
+// helper for find_roles
+// note an indirect block, and the blocks it lists down depth more levels
+static void note_list(struct checker *fc, struct checker *image, struct diff_role *roles,
+                      uint block, uint inode_number, int kind, int depth)
+{
+    uint *listed = (uint *)block_of(image, block);
+    uint i;
+
+    if (block == 0 || listed == NULL)
+    {
+        return;
+    }
+
+    note_role(fc, roles, block, inode_number, DIFF_LIST);
+    for (i = 0; i < NINDIRECT; i++)
+    {
+        if (depth > 0)
+        {
+            note_list(fc, image, roles, listed[i], inode_number, kind, depth - 1);
+        }
+        else if (listed[i] != 0)
+        {
+            note_role(fc, roles, listed[i], inode_number, kind);
+        }
+    }
+}
+
+// helper for diff_images
+// find which inode of one image each changed data block belongs to, and as
+// what, by following every inode's pointers
+static void find_roles(struct checker *fc, struct checker *image, struct diff_role *roles)
+{
+    struct superblock *sb = (struct superblock *)block_of(image, 1);
+    uint inode_number;
+    int j;
+
+    for (inode_number = 1; sb != NULL && inode_number < sb->ninodes; inode_number++)
+    {
+        struct dinode *inodes = (struct dinode *)block_of(image, IBLOCK(inode_number));
+        if (inodes == NULL)
+        {
+            break;
+        }
+
+        struct dinode *inode = &inodes[inode_number % IPB];
+        if (inode->type < T_DIR || inode->type > T_DEV)
+        {
+            continue;
+        }
+
+        int kind = inode->type == T_DIR ? DIFF_DIRECTORY : DIFF_DATA;
+        for (j = 0; j < NDIRECT; j++)
+        {
+            if (inode->addrs[j] != 0)
+            {
+                note_role(fc, roles, inode->addrs[j], inode_number, kind);
+            }
+        }
+        for (j = 0; j <= DOUBLE_INDIRECT; j++)
+        {
+            note_list(fc, image, roles, inode->addrs[NDIRECT + j], inode_number, kind, j);
+        }
+    }
+}
+
+// helper for diff_images
+// name what changed in the superblock
+static void diff_superblock(struct checker *fc)
+{
+    struct superblock *before = (struct superblock *)block_of(fc->diff.old, 1);
+    char line[256] = "";
+
+    add_field(line, sizeof(line), "size", before->size, fc->superblock.size);
+    add_field(line, sizeof(line), "nblocks", before->nblocks, fc->superblock.nblocks);
+    add_field(line, sizeof(line), "ninodes", before->ninodes, fc->superblock.ninodes);
+    report_change(fc, "superblock: %s", line[0] != '\0' ? line + 2 : "unused bytes changed");
+}
+
+// helper for diff_images
+// name every field that changed in each inode of an inode block
+static void diff_inode_block(struct checker *fc, uint block)
+{
+    struct dinode *before = (struct dinode *)block_of(fc->diff.old, block);
+    struct dinode *after = (struct dinode *)block_of(fc, block);
+    char line[1024], name[32];
+    int i, j;
+
+    for (i = 0; i < IPB; i++)
+    {
+        if (memcmp(&before[i], &after[i], sizeof(struct dinode)) == 0)
+        {
+            continue;
+        }
+
+        line[0] = '\0';
+        add_field(line, sizeof(line), "type", before[i].type, after[i].type);
+        add_field(line, sizeof(line), "major", before[i].major, after[i].major);
+        add_field(line, sizeof(line), "minor", before[i].minor, after[i].minor);
+        add_field(line, sizeof(line), "nlink", before[i].nlink, after[i].nlink);
+        add_field(line, sizeof(line), "size", before[i].size, after[i].size);
+        for (j = 0; j < NDIRECT + 1 + DOUBLE_INDIRECT; j++)
+        {
+            snprintf(name, sizeof(name), "addrs[%d]", j);
+            add_field(line, sizeof(line), name, before[i].addrs[j], after[i].addrs[j]);
+        }
+        report_change(fc, "inode %ld: %s", (long)(block - IBLOCK(0)) * IPB + i, line + 2);
+    }
+}
+
+// helper for diff_bitmap_block and diff_images
+// report the run of bitmap bits flipped the same way, if any
+static void end_bit_run(struct checker *fc)
+{
+    if (fc->diff.run_first > fc->diff.run_last)
+    {
+        return;
+    }
+
+    const char *state = fc->diff.run_marked ? "in use" : "free";
+    if (fc->diff.run_first == fc->diff.run_last)
+    {
+        report_change(fc, "bitmap: block %ld marked %s", fc->diff.run_first, state);
+    }
+    else
+    {
+        report_change(fc, "bitmap: blocks %ld-%ld marked %s", fc->diff.run_first,
+                      fc->diff.run_last, state);
+    }
+    fc->diff.run_first = 0;
+    fc->diff.run_last = -1;
+}
+
+// helper for diff_images
+// name the blocks whose bits flipped, joining neighbours flipped the same way
+static void diff_bitmap_block(struct checker *fc, uint block)
+{
+    unsigned char *before = (unsigned char *)block_of(fc->diff.old, block);
+    unsigned char *after = (unsigned char *)block_of(fc, block);
+    int i, bit;
+
+    for (i = 0; i < BSIZE; i++)
+    {
+        for (bit = 0; before[i] != after[i] && bit < 8; bit++)
+        {
+            if (((before[i] ^ after[i]) >> bit & 1) == 0)
+            {
+                continue;
+            }
+
+            long number = (long)(block - fc->bitmap_start) * BPB + i * 8 + bit;
+            int marked = after[i] >> bit & 1;
+            if (number != fc->diff.run_last + 1 || marked != fc->diff.run_marked)
+            {
+                end_bit_run(fc);
+                fc->diff.run_first = number;
+                fc->diff.run_marked = marked;
+            }
+            fc->diff.run_last = number;
+        }
+    }
+}
+
+// helper for diff_images
+// name what changed in a data block, as what it is to an inode before and
+// after: entries of a directory, entries of an indirect block, or data
+static void diff_data_block(struct checker *fc, long i)
+{
+    uint block = fc->diff.data_blocks[i];
+    struct diff_role before = fc->diff.roles[0][i], after = fc->diff.roles[1][i];
+    char *bytes[2] = { block_of(fc->diff.old, block), block_of(fc, block) };
+    struct diff_role *owner = after.kind != DIFF_FREE ? &after : &before;
+    uint entry;
+
+    if (before.kind == DIFF_DIRECTORY || after.kind == DIFF_DIRECTORY)
+    {
+        struct dirent empty = { 0 };
+
+        for (entry = 0; entry < BSIZE / sizeof(struct dirent); entry++)
+        {
+            struct dirent *old = before.kind == DIFF_DIRECTORY ? (struct dirent *)bytes[0] + entry : &empty;
+            struct dirent *new = after.kind == DIFF_DIRECTORY ? (struct dirent *)bytes[1] + entry : &empty;
+
+            if (memcmp(old, new, sizeof(struct dirent)) == 0)
+            {
+                continue;
+            }
+            if (old->inum != 0)
+            {
+                report_change(fc, "directory %u: removed \"%.*s\" (inode %u)", before.inode,
+                              DIRSIZ, old->name, old->inum);
+            }
+            if (new->inum != 0)
+            {
+                report_change(fc, "directory %u: added \"%.*s\" (inode %u)", after.inode,
+                              DIRSIZ, new->name, new->inum);
+            }
+        }
+    }
+    else if (before.kind == DIFF_LIST || after.kind == DIFF_LIST)
+    {
+        uint *old = (uint *)bytes[0], *new = (uint *)bytes[1];
+
+        for (entry = 0; entry < NINDIRECT; entry++)
+        {
+            uint was = before.kind == DIFF_LIST ? old[entry] : 0;
+            uint is = after.kind == DIFF_LIST ? new[entry] : 0;
+
+            if (was != is)
+            {
+                report_change(fc, "inode %u: indirect block %u: entry %u %u -> %u", owner->inode,
+                              block, entry, was, is);
+            }
+        }
+    }
+    else if (owner->kind == DIFF_DATA)
+    {
+        report_change(fc, "inode %u: data block %u changed", owner->inode, block);
+    }
+    else
+    {
+        report_change(fc, "block %u: changed, not in use", block);
+    }
+}
+
+// helper for check_image
+// compare the image with the one fcheck_diff gave first, block by block,
+// then name what changed in each block that differs, as the new image's
+// layout says it is used
+static void diff_images(struct checker *fc)
+{
+    struct checker *old = fc->diff.old;
+    long block, i;
+
+    if (setjmp(old->abort) != 0)
+    {
+        give_up(fc, "old image could not be opened.");
+    }
+    open_image(old);
+
+    long old_blocks = old->file_stat.st_size / BSIZE;
+    long new_blocks = fc->file_stat.st_size / BSIZE;
+    if (old_blocks != new_blocks)
+    {
+        report_change(fc, "image: %ld blocks -> %ld blocks", old_blocks, new_blocks);
+    }
+    fc->diff.blocks = old_blocks < new_blocks ? old_blocks : new_blocks;
+
+    compare_blocks(fc);
+
+    // the data blocks that changed, and what each was and is
+    fc->diff.data_blocks = malloc((fc->diff.blocks + 1) * sizeof(uint));
+    if (fc->diff.data_blocks == NULL)
+    {
+        out_of_memory(fc);
+    }
+    for (block = fc->datablocks_start; block < fc->diff.blocks; block++)
+    {
+        if (bitset_test(fc->diff.changed, block))
+        {
+            fc->diff.data_blocks[fc->diff.data_count++] = block;
+        }
+    }
+    fc->diff.roles[0] = calloc(fc->diff.data_count + 1, sizeof(struct diff_role));
+    fc->diff.roles[1] = calloc(fc->diff.data_count + 1, sizeof(struct diff_role));
+    if (fc->diff.roles[0] == NULL || fc->diff.roles[1] == NULL)
+    {
+        out_of_memory(fc);
+    }
+    if (fc->diff.data_count > 0)
+    {
+        find_roles(fc, old, fc->diff.roles[0]);
+        find_roles(fc, fc, fc->diff.roles[1]);
+    }
+
+    fc->diff.run_first = 0;
+    fc->diff.run_last = -1;
+    for (block = 0, i = 0; block < fc->diff.blocks; block++)
+    {
+        if (!bitset_test(fc->diff.changed, block))
+        {
+            continue;
+        }
+
+        if (block < fc->bitmap_start || block >= fc->datablocks_start)
+        {
+            end_bit_run(fc);
+        }
+
+        if (block == 1)
+        {
+            diff_superblock(fc);
+        }
+        else if (block >= IBLOCK(0) && fc->superblock.ninodes > 0 &&
+                 block <= IBLOCK(fc->superblock.ninodes - 1))
+        {
+            diff_inode_block(fc, block);
+        }
+        else if (block >= fc->bitmap_start && block < fc->datablocks_start)
+        {
+            diff_bitmap_block(fc, block);
+        }
+        else if (block >= fc->datablocks_start)
+        {
+            diff_data_block(fc, i++);
+        }
+        else
+        {
+            report_change(fc, "block %ld: changed, not in use", block);
+        }
+    }
+    end_bit_run(fc);
+}
+
+// helper for check_image
+// close file and free memory
+// the errors found are kept for the caller to report
+static void cleanup(struct checker *fc)
+{
+    int i;
+
+    stop_prefetch(fc);
+
+    if (fc->unmap_image)
+    {
+        COUNT(fc, syscalls, 1);
+        munmap(fc->mem_map_image, fc->file_stat.st_size);
+    }
+    for (i = 0; i < 2; i++)
+    {
+        if (fc->windows[i].base != NULL)
+        {
+            COUNT(fc, syscalls, 1);
+            munmap(fc->windows[i].base, fc->windows[i].length);
+        }
+    }
+    if (fc->close_image)
+    {
+        COUNT(fc, syscalls, 1);
+        close(fc->fsfd);
+    }
+    free(fc->bitmap);
+    free(fc->accounting.block_used);
+    free(fc->references.references);
+    free(fc->links);
+    free(fc->walked);
+    free(fc->stack.directories);
+    for (i = 0; i < fc->patches.count; i++)
+    {
+        free(fc->patches.patches[i].bytes);
+    }
+    free(fc->patches.patches);
+    free_facts(&fc->cache);
+    free(fc->cache.blocks);
+    current_facts = NULL;
+    free(fc->diff.changed);
+    free(fc->diff.data_blocks);
+    free(fc->diff.roles[0]);
+    free(fc->diff.roles[1]);
+    if (fc->diff.old != NULL)
+    {
+        cleanup(fc->diff.old);
+    }
+}
+
+#ifdef DEFAULT_GEOMETRY
+
+typedef int (*check_function)(struct checker *fc, const struct fcheck_options *options,
+                              struct fcheck_result *result);
+
+static int check_image(struct checker *fc, const struct fcheck_options *options,
+                       struct fcheck_result *result);
+
+// the entry points of the builds in geometry/, NULL for any not linked in
+int fcheck_geometry_1024(struct checker *, const struct fcheck_options *,
+                         struct fcheck_result *) __attribute__((weak));
+int fcheck_geometry_4096(struct checker *, const struct fcheck_options *,
+                         struct fcheck_result *) __attribute__((weak));
+int fcheck_geometry_512_double(struct checker *, const struct fcheck_options *,
+                               struct fcheck_result *) __attribute__((weak));
+int fcheck_geometry_1024_double(struct checker *, const struct fcheck_options *,
+                                struct fcheck_result *) __attribute__((weak));
+int fcheck_geometry_4096_double(struct checker *, const struct fcheck_options *,
+                                struct fcheck_result *) __attribute__((weak));
+
+// the block sizes an image can have, in the order they are tried
+static const int block_sizes[] = { BSIZE, 1024, 4096 };
+
+// the geometry each build checks
+static const struct geometry
+{
+    int block_size;
+    int double_indirect;
+    check_function check;
+} geometries[] = {
+    { BSIZE, 0, check_image },
+    { 1024, 0, fcheck_geometry_1024 },
+    { 4096, 0, fcheck_geometry_4096 },
+    { BSIZE, 1, fcheck_geometry_512_double },
+    { 1024, 1, fcheck_geometry_1024_double },
+    { 4096, 1, fcheck_geometry_4096_double },
+};
+
+// helper for check_image
+// the build for the geometry of an open image
+// the block size is the one asked for, or else the first whose superblock,
+// one block into the image, gives the image's size; the inode layout cannot
+// be told from the image, so it is the one asked for
+static check_function find_geometry(struct checker *fc)
+{
+    int block_size = fc->block_size;
+    size_t i;
+
+    for (i = 0; block_size == 0 && i < sizeof(block_sizes) / sizeof(block_sizes[0]); i++)
+    {
+        off_t at = block_sizes[i];
+
+        if (at + (off_t)sizeof(struct superblock) <= fc->file_stat.st_size &&
+            (off_t)((struct superblock *)image_at(fc, at, sizeof(struct superblock)))->size * at ==
+                fc->file_stat.st_size)
+        {
+            block_size = at;
+        }
+    }
+    if (block_size == 0)
+    {
+        block_size = BSIZE;
+    }
+
+    for (i = 0; i < sizeof(geometries) / sizeof(geometries[0]); i++)
+    {
+        if (geometries[i].block_size == block_size &&
+            geometries[i].double_indirect == (fc->double_indirect != 0))
+        {
+            if (geometries[i].check == NULL)
+            {
+                give_up(fc, "image geometry is not built in.");
+            }
+            return geometries[i].check;
+        }
+    }
+
+    give_up(fc, "image geometry is not supported.");
+    return NULL;
+}
+
+#endif
+
+// helper for the fcheck_ functions
+// check one image, whose source and options are already set in fc
+// returns EXIT_SUCCESS if the image was checked and no errors were found
+static int check_image(struct checker *fc, const struct fcheck_options *options,
+                       struct fcheck_result *result)
+{
+    fc->threads = 1;
+    if (options != NULL)
+    {
+        fc->threads = options->threads;
+        fc->collect_all = options->collect_all;
+        fc->ordered = options->ordered;
+        fc->stats = options->stats;
+        fc->quick = options->quick;
+        fc->paths = options->paths;
+        fc->keep_index = options->index;
+        fc->repair = options->repair;
+        fc->undo_log = options->undo_log;
+        fc->memory = options->memory;
+        fc->prefetch = options->prefetch;
+        fc->block_size = options->block_size;
+        fc->double_indirect = options->double_indirect;
+        fc->cache_path = options->cache;
+    }
+    if (fc->threads < 1 || fc->threads > MAX_THREADS)
+    {
+        fc->threads = fc->threads < 1 ? 1 : MAX_THREADS;
+    }
+    // a directory inode needs room to read ahead all its blocks at once
+    if (fc->prefetch > 0 && fc->prefetch < NDIRECT + 1 + DOUBLE_INDIRECT)
+    {
+        fc->prefetch = NDIRECT + 1 + DOUBLE_INDIRECT;
+    }
+    if (fc->prefetch > 4096)
+    {
+        fc->prefetch = 4096;
+    }
+    fc->failed_worker = MAX_THREADS;
+
+    // an image handed on by the default build is already open, in a phase
+    // that keeps running here
+    if (!fc->opened)
+    {
+        fc->phase = NONE;
+        fc->started = fc->stats ? now() : 0;
+        begin_phase(fc, FCHECK_INIT);
+    }
+
+    // repairs come from every error, and the counts only a full check keeps
+    if (fc->repair)
+    {
+        fc->collect_all = 1;
+        fc->quick = 0;
+    }
+
+    // with --mem blocks are read in disk order, so each window moves forward
+    if (fc->memory > 0)
+    {
+        fc->ordered = 1;
+    }
+
+    // the cache keeps what a full check of an image it can map finds, block
+    // by block, and the checks that differ from that do not keep it
+    if (fc->quick || fc->ordered || fc->repair)
+    {
+        fc->cache_path = NULL;
+    }
+
+    // ordered mode collects block uses from a single scan of the inode table
+    if (fc->ordered && !fc->quick)
+    {
+        fc->threads = 1;
+        fc->defer_errors = 1;
+    }
+
+    if (setjmp(fc->abort) == 0)
+    {
+        open_image(fc);
+#ifdef DEFAULT_GEOMETRY
+        check_function check = find_geometry(fc);
+        if (check != check_image)
+        {
+            return check(fc, options, result);
+        }
+#endif
+        init(fc);
+        if (fc->threads == 1)
+        {
+            start_prefetch(fc);
+        }
+
+        if (fc->diff.old != NULL)
+        {
+            diff_images(fc);
+        }
+        else if (fc->quick)
+        {
+            quick_check_geometry(fc);
+            begin_phase(fc, FCHECK_GET_BITMAP_INFO);
+            get_bitmap_info(fc);
+            begin_phase(fc, FCHECK_CHECK_INODES);
+            quick_check_inodes(fc);
+            begin_phase(fc, FCHECK_CHECK_BITMAP);
+            quick_check_bitmap(fc);
+        }
+        else
+        {
+            begin_phase(fc, FCHECK_GET_BITMAP_INFO);
+            get_bitmap_info(fc);
+            begin_phase(fc, FCHECK_CHECK_INODES);
+            // an image unchanged since its last clean check is clean
+            if (fc->cache_path == NULL || !compare_digests(fc))
+            {
+                check_inodes(fc);
+                if (fc->ordered)
+                {
+                    begin_phase(fc, FCHECK_CHECK_REFERENCES);
+                    check_references(fc);
+                }
+                begin_phase(fc, FCHECK_CHECK_BITMAP);
+                check_bitmap(fc);
+                begin_phase(fc, FCHECK_CHECK_DIRECTORIES);
+                check_directories(fc);
+                // the walk only reads directories, so it finds what it did
+                // before unless one of them changed
+                if (fc->cache.blocks == NULL || fc->cache.directories_changed)
+                {
+                    begin_phase(fc, FCHECK_CHECK_REACHABILITY);
+                    check_reachability(fc);
+                }
+                save_cache(fc);
+            }
+        }
+    }
+
+    // the walk can still name bad inodes after the first error ends the
+    // check, and index names after a quick check, which does not walk
+    // setjmp is only allowed as the whole of a condition, so it gets an if
+    // of its own
+    if (((fc->paths && fc->errors.count > 0) || fc->keep_index) && fc->laid_out &&
+        (fc->mem_map_image != NULL || fc->windowed))
+    {
+        if (setjmp(fc->abort) == 0)
+        {
+            if (fc->links == NULL)
+            {
+                walk(fc, 0);
+            }
+            if (fc->paths)
+            {
+                name_errors(fc);
+            }
+        }
+    }
+
+    if (fc->repair && fc->laid_out && fc->problem == NULL && fc->errors.count > 0)
+    {
+        if (setjmp(fc->abort) == 0)
+        {
+            begin_phase(fc, FCHECK_REPAIR_IMAGE);
+            plan_repairs(fc);
+            write_repairs(fc);
+        }
+    }
+
+    begin_phase(fc, FCHECK_CLEANUP);
+    cleanup(fc);
+    begin_phase(fc, NONE);
+
+    // an index the walk could not finish would answer wrongly
+    if (fc->problem != NULL)
+    {
+        free_index(fc->index);
+        fc->index = NULL;
+    }
+
+    result->problem = fc->problem;
+    result->index = fc->index;
+    result->errors = fc->errors.records;
+    result->error_count = fc->errors.count;
+    memcpy(result->phases, fc->phases, sizeof(fc->phases));
+    result->workers = NULL;
+    result->worker_count = 0;
+    if (fc->worker_count > 0 &&
+        (result->workers = malloc(fc->worker_count * sizeof(struct fcheck_stats))) != NULL)
+    {
+        memcpy(result->workers, fc->workers, fc->worker_count * sizeof(struct fcheck_stats));
+        result->worker_count = fc->worker_count;
+    }
+
+    return fc->problem == NULL && fc->errors.count == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+#ifndef DEFAULT_GEOMETRY
+
+// the entry point of this build, for the default build to hand on an image
+// of this geometry it has opened
+int FCHECK_GEOMETRY(struct checker *fc, const struct fcheck_options *options,
+                    struct fcheck_result *result)
+{
+    return check_image(fc, options, result);
+}
+
+#else
+
+// helper for the fcheck_ functions
+// check an image from a copy of source
+// errors among facts taken from the cache are found again without it, so
+// that they are found as a check from scratch finds them
+static int check_source(const struct checker *source, const struct fcheck_options *options,
+                        struct fcheck_result *result)
+{
+    struct checker checker = *source;
+    int status = check_image(&checker, options, result);
+
+    if (checker.cache.replayed && result->problem == NULL && result->error_count > 0)
+    {
+        struct fcheck_options again = *options;
+
+        again.cache = NULL;
+        fcheck_free_result(result);
+        checker = *source;
+        status = check_image(&checker, &again, result);
+    }
+
+    return status;
+}
+
+int fcheck_path(const char *path, const struct fcheck_options *options,
+                struct fcheck_result *result)
+{
+    struct checker checker = { .image_path = path, .fsfd = -1 };
+
+    return check_source(&checker, options, result);
+}
+
+int fcheck_fd(int fd, const struct fcheck_options *options, struct fcheck_result *result)
+{
+    struct checker checker = { .fsfd = fd };
+
+    return check_source(&checker, options, result);
+}
+
+int fcheck_buffer(const void *image, size_t size, const struct fcheck_options *options,
+                  struct fcheck_result *result)
+{
+    struct checker checker = { .fsfd = -1, .mem_map_image = (char *)image };
+
+    checker.file_stat.st_size = size;
+    if (image == NULL)
+    {
+        result->problem = "image not found.";
+        result->index = NULL;
+        result->errors = NULL;
+        result->error_count = 0;
+        memset(result->phases, 0, sizeof(result->phases));
+        result->workers = NULL;
+        result->worker_count = 0;
+        return EXIT_FAILURE;
+    }
+
+    return check_source(&checker, options, result);
+}
+
+const char *fcheck_diff(const char *old_path, const char *new_path,
+                        const struct fcheck_options *options,
+                        void (*visit)(const char *change, void *arg), void *arg)
+{
+    struct checker old = { .image_path = old_path, .fsfd = -1 };
+    struct checker checker = { .image_path = new_path, .fsfd = -1,
+                               .diff = { .old = &old, .visit = visit, .arg = arg } };
+    struct fcheck_options diff = { .threads = 1 };
+    struct fcheck_result result;
+
+    // only the geometry and threads apply, and both images are mapped whole
+    if (options != NULL)
+    {
+        diff.threads = options->threads;
+        diff.block_size = options->block_size;
+        diff.double_indirect = options->double_indirect;
+    }
+
+    check_image(&checker, &diff, &result);
+    fcheck_free_result(&result);
+    return result.problem;
+}
+
+void fcheck_free_result(struct fcheck_result *result)
+{
+    int i;
+    for (i = 0; i < result->error_count; i++)
+    {
+        free(result->errors[i].path);
+    }
+    free(result->errors);
+    free(result->workers);
+    free_index(result->index);
+    result->index = NULL;
+    result->errors = NULL;
+    result->error_count = 0;
+    result->workers = NULL;
+    result->worker_count = 0;
+}
+
+long fcheck_lookup(const struct fcheck_index *index, const char *path)
+{
+    uint current = ROOTINO;
+
+    if (index == NULL || path == NULL)
+    {
+        return NONE;
+    }
+
+    while (*path != '\0')
+    {
+        size_t length = strcspn(path, "/");
+
+        if (length == 2 && memcmp(path, "..", 2) == 0)
+        {
+            // the directory the walk first found this one in
+            if (current != ROOTINO && index->first[current] != 0)
+            {
+                current = index->names[index->first[current] - 1].directory;
+            }
+        }
+        else if (length > 0 && !(length == 1 && path[0] == '.'))
+        {
+            uint found = length <= DIRSIZ ? find_name(index, current, path, length) : 0;
+            if (found == 0)
+            {
+                return NONE;
+            }
+            current = index->names[found - 1].inode;
+        }
+
+        path += length;
+        path += *path == '/';
+    }
+
+    return current;
+}
+
+// helper for fcheck_whohas
+// the path of a name, through the first name of each directory above it,
+// from the root or from the top of a tree the root cannot reach
+static char *name_path(const struct fcheck_index *index, uint name_number)
+{
+    size_t length = 0;
+    uint current = name_number;
+    uint depth = 0;
+    uint directory;
+
+    // first find the length and the top of the tree, then fill the path in
+    // from its end
+    for (;;)
+    {
+        length += 1 + strnlen(index->names[current].name, DIRSIZ);
+        depth++;
+        directory = index->names[current].directory;
+        if (directory == ROOTINO || index->first[directory] == 0 || depth > index->count)
+        {
+            break;
+        }
+        current = index->first[directory] - 1;
+    }
+
+    char top[32] = "";
+    if (directory != ROOTINO)
+    {
+        snprintf(top, sizeof(top), "(inode %u)", directory);
+    }
+
+    size_t top_length = strlen(top);
+    char *path = malloc(top_length + length + 1);
+    if (path == NULL)
+    {
+        return NULL;
+    }
+
+    memcpy(path, top, top_length);
+    char *end = path + top_length + length;
+    *end = '\0';
+    for (current = name_number; depth > 0; depth--)
+    {
+        const char *name = index->names[current].name;
+        size_t name_length = strnlen(name, DIRSIZ);
+
+        end -= name_length;
+        memcpy(end, name, name_length);
+        *--end = '/';
+        if (depth > 1)
+        {
+            current = index->first[index->names[current].directory] - 1;
+        }
+    }
+
+    return path;
+}
+
+int fcheck_whohas(const struct fcheck_index *index, long inode,
+                  void (*visit)(const char *path, void *arg), void *arg)
+{
+    int count = 0;
+    uint name;
+
+    if (index == NULL || inode <= 0 || inode >= index->ninodes)
+    {
+        return 0;
+    }
+
+    if (inode == ROOTINO)
+    {
+        visit("/", arg);
+        count++;
+    }
+
+    for (name = index->first[inode]; name != 0; name = index->names[name - 1].next)
+    {
+        char *path = name_path(index, name - 1);
+        if (path == NULL)
+        {
+            return -1;
+        }
+        visit(path, arg);
+        free(path);
+        count++;
+    }
+
+    return count;
+}
+
+const char *fcheck_undo(const char *path, const char *undo_log)
+{
+    const char *problem = NULL;
+    char *log = NULL;
+    long length = 0;
+    int image = -1;
+    FILE *undo = fopen(undo_log, "rb");
+
+    // the whole log is read first, so a short one changes nothing
+    if (undo == NULL)
+    {
+        return "undo log not found.";
+    }
+    if (fseek(undo, 0, SEEK_END) < 0 || (length = ftell(undo)) < 0 ||
+        fseek(undo, 0, SEEK_SET) < 0 || (log = malloc(length + 1)) == NULL ||
+        fread(log, 1, length, undo) != (size_t)length)
+    {
+        problem = "undo log could not be read.";
+    }
+    fclose(undo);
+
+    size_t magic = sizeof(UNDO_MAGIC) - 1;
+    uint64_t size = 0;
+    if (problem == NULL &&
+        ((size_t)length < magic + sizeof(size) || memcmp(log, UNDO_MAGIC, magic) != 0))
+    {
+        problem = "not an undo log.";
+    }
+
+    // the records are checked, then written back last to first; each one
+    // takes at least a header, which bounds how many there can be
+    long *records = problem == NULL ? malloc((length / 16 + 1) * sizeof(long)) : NULL;
+    long at = magic + sizeof(size);
+    int count = 0;
+    if (problem == NULL && records == NULL)
+    {
+        problem = "undo log could not be read.";
+    }
+    if (problem == NULL)
+    {
+        memcpy(&size, log + magic, sizeof(size));
+    }
+    while (problem == NULL && at < length)
+    {
+        uint64_t header[2];
+        if (length - at < (long)sizeof(header))
+        {
+            problem = "undo log is cut short.";
+            break;
+        }
+        memcpy(header, log + at, sizeof(header));
+        if (header[1] > (uint64_t)(length - at - sizeof(header)) / 2)
+        {
+            problem = "undo log is cut short.";
+            break;
+        }
+        records[count++] = at;
+        at += sizeof(header) + 2 * header[1];
+    }
+
+    struct stat image_stat;
+    if (problem == NULL && (image = open(path, O_RDWR)) < 0)
+    {
+        problem = errno == ENOENT ? "image not found." : "image could not be opened for writing.";
+    }
+    if (problem == NULL && (fstat(image, &image_stat) < 0 || (uint64_t)image_stat.st_size != size))
+    {
+        problem = "image is not the one repaired.";
+    }
+
+    // the image must still hold what the repair wrote, or putting back the
+    // bytes it replaced would damage whatever has changed since
+    int i;
+    for (i = 0; problem == NULL && i < count; i++)
+    {
+        uint64_t header[2];
+        char *written;
+
+        memcpy(header, log + records[i], sizeof(header));
+        written = log + records[i] + sizeof(header) + header[1];
+        char *now = malloc(header[1] + 1);
+        if (now == NULL)
+        {
+            problem = "undo log could not be read.";
+        }
+        else if (pread(image, now, header[1], header[0]) != (ssize_t)header[1] ||
+                 memcmp(now, written, header[1]) != 0)
+        {
+            problem = "image is not the one repaired.";
+        }
+        free(now);
+    }
+
+    while (problem == NULL && count > 0)
+    {
+        uint64_t header[2];
+
+        at = records[--count];
+        memcpy(header, log + at, sizeof(header));
+        if (pwrite(image, log + at + sizeof(header), header[1], header[0]) != (ssize_t)header[1])
+        {
+            problem = "image could not be restored.";
+        }
+    }
+    if (problem == NULL && fsync(image) < 0)
+    {
+        problem = "image could not be restored.";
+    }
+
+    if (image >= 0)
+    {
+        close(image);
+    }
+    free(records);
+    free(log);
+
+    return problem;
+}
+
+const char *fcheck_message(int error)
+{
+    return error >= 0 && error < FCHECK_ERROR_CLASSES ? error_messages[error] : NULL;
+}
+
+const char *fcheck_name(int error)
+{
+    return error >= 0 && error < FCHECK_ERROR_CLASSES ? error_names[error] : NULL;
+}
+
+const char *fcheck_phase_name(int phase)
+{
+    return phase >= 0 && phase < FCHECK_PHASES ? phase_names[phase] : NULL;
+}
+
+#endif
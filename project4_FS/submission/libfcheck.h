@@ -0,0 +1,191 @@
+// libfcheck: check an xv6 file system image (see fs.h) without a process
+// an image can come from a path, an open file descriptor or a buffer already
+// in memory, and the errors found are returned instead of printed
+
+#ifndef LIBFCHECK_H
+#define LIBFCHECK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FCHECK_MAX_THREADS 64
+#define FCHECK_NONE -1
+
+// the classes of error the checker can find
+enum fcheck_error_class
+{
+    FCHECK_BAD_INODE,
+    FCHECK_BAD_DIRECT_ADDRESS,
+    FCHECK_BAD_INDIRECT_ADDRESS,
+    FCHECK_NO_ROOT_DIRECTORY,
+    FCHECK_BAD_DIRECTORY_FORMAT,
+    FCHECK_ADDRESS_MARKED_FREE,
+    FCHECK_BLOCK_NOT_IN_USE,
+    FCHECK_DIRECT_ADDRESS_REUSED,
+    FCHECK_INDIRECT_ADDRESS_REUSED,
+    FCHECK_INODE_NOT_IN_DIRECTORY,
+    FCHECK_INODE_MARKED_FREE,
+    FCHECK_BAD_REFERENCE_COUNT,
+    FCHECK_DIRECTORY_REUSED,
+    FCHECK_BLOCK_OUTSIDE_IMAGE,
+    FCHECK_BAD_SUPERBLOCK,   // by quick checks, or by any check if the layout is past the image
+    FCHECK_BITMAP_COUNT,     // only found by quick checks
+    FCHECK_DIRECTORY_UNREACHABLE,
+    FCHECK_PARENT_MISMATCH,
+    FCHECK_DIRECTORY_CYCLE,
+    FCHECK_ERROR_CLASSES
+};
+
+// the phases of a check, in the order they run
+enum fcheck_phase
+{
+    FCHECK_INIT,
+    FCHECK_GET_BITMAP_INFO,
+    FCHECK_CHECK_INODES,
+    FCHECK_CHECK_REFERENCES,
+    FCHECK_CHECK_BITMAP,
+    FCHECK_CHECK_DIRECTORIES,
+    FCHECK_CHECK_REACHABILITY,
+    FCHECK_REPAIR_IMAGE,
+    FCHECK_CLEANUP,
+    FCHECK_PHASES
+};
+
+// how to check an image, NULL means one thread and stop at the first error
+struct fcheck_options
+{
+    int threads;      // threads checking the inode table, 1 to FCHECK_MAX_THREADS
+    int collect_all;  // keep checking after the first error
+    int ordered;      // read indirect and directory blocks in disk order
+    int stats;        // time each phase and count what it does
+    int quick;        // only the checks that need no directory contents
+    int paths;        // name where in the tree each bad inode is
+    int index;        // keep every name found, for fcheck_lookup and fcheck_whohas
+    // fix the errors that have one right fix, and implies collect_all; an
+    // image given as a buffer is only checked, never written
+    int repair;
+    const char *undo_log;  // with repair, where to save the bytes replaced, or NULL
+
+    // read the image through windows that, with the queue of blocks waiting
+    // to be read, take about this many bytes, instead of mapping it whole;
+    // implies ordered, and 0 maps the whole image
+    size_t memory;
+
+    // how many directory and indirect blocks to read ahead asynchronously,
+    // with io_uring or a few threads, or 0 for none
+    int prefetch;
+
+    // the image's block size, 512, 1024 or 4096, or 0 to find it from where
+    // the superblock is
+    int block_size;
+    // inodes have one direct pointer fewer, and a double-indirect pointer
+    // after the indirect one
+    int double_indirect;
+
+    // a file keeping a digest of each inode block and of the blocks read
+    // through it, with what a clean check found there; a check only looks
+    // again at what changed since, and rewrites the file if still clean
+    // ignored by quick, ordered, memory and repair checks, or NULL
+    const char *cache;
+};
+
+// what one phase, or one thread of check_inodes, did
+// only filled in when the options ask for stats
+struct fcheck_stats
+{
+    double start;           // seconds from the start of the check
+    double seconds;         // wall time
+    long blocks_read;       // blocks looked up in the image
+    long bytes_touched;     // bytes of the image read
+    long syscalls;          // system calls made by the checker itself
+    long directory_blocks;  // directory blocks visited
+    long indirect_blocks;   // indirect blocks visited
+    long data_blocks;       // file data blocks accounted for, never read
+};
+
+// one error found while checking
+struct fcheck_error
+{
+    int error;     // an fcheck_error_class
+    long inode;    // the inode at fault, or FCHECK_NONE
+    long block;    // the block at fault, or FCHECK_NONE
+    uint64_t key;  // where a single-threaded check finds the error
+    char *path;    // with the paths option, where the inode is, or NULL
+    int repaired;  // with the repair option, the fix was written to the image
+};
+
+// the names in an image's directories, kept by a check with the index option
+struct fcheck_index;
+
+// what was found in one image
+// errors holds the first error, or every error with collect_all, in the
+// order a single-threaded check finds them
+struct fcheck_result
+{
+    const char *problem;  // why the image could not be checked at all, or NULL
+    struct fcheck_index *index;  // with the index option, the names found
+    struct fcheck_error *errors;
+    int error_count;
+
+    // a phase that did not run has no time and no counts
+    // workers holds one entry per check_inodes thread, if more than one ran
+    struct fcheck_stats phases[FCHECK_PHASES];
+    struct fcheck_stats *workers;
+    int worker_count;
+};
+
+// check an image, filling in result
+// each returns 0 if the image was checked and no errors were found, else 1
+// an image that cannot be seeked, such as a pipe, is first copied to a
+// temporary file
+// any number of images can be checked at once from different threads
+int fcheck_path(const char *path, const struct fcheck_options *options,
+                struct fcheck_result *result);
+int fcheck_fd(int fd, const struct fcheck_options *options, struct fcheck_result *result);
+int fcheck_buffer(const void *image, size_t size, const struct fcheck_options *options,
+                  struct fcheck_result *result);
+
+// put back the bytes a repair replaced, from its undo log, if the image is
+// still the size it was and holds the bytes the repair wrote
+// returns NULL, or why the image could not be restored
+const char *fcheck_undo(const char *path, const char *undo_log);
+
+// compare two images block by block, on as many threads as the options
+// ask for, and pass each difference, as a line of text, to visit: superblock
+// fields, inode fields, bitmap bits, directory entries added and removed,
+// and entries of indirect blocks, in block order; the new image's layout
+// says what each block is
+// returns NULL, or why the images could not be compared
+const char *fcheck_diff(const char *old_path, const char *new_path,
+                        const struct fcheck_options *options,
+                        void (*visit)(const char *change, void *arg), void *arg);
+
+// free the errors, stats and index held by a result
+void fcheck_free_result(struct fcheck_result *result);
+
+// the inode a path leads to, from the root, or FCHECK_NONE
+// takes as many steps as the path has parts
+long fcheck_lookup(const struct fcheck_index *index, const char *path);
+
+// pass the path of every name an inode has to visit, and return how many there
+// are, or -1 if memory ran out; each path is only valid during its call
+// a directory the root cannot reach is named as in fcheck_error paths
+int fcheck_whohas(const struct fcheck_index *index, long inode,
+                  void (*visit)(const char *path, void *arg), void *arg);
+
+// the message fcheck prints for an error class, and its name in reports
+const char *fcheck_message(int error);
+const char *fcheck_name(int error);
+
+// the name of a phase, as in the checker's source
+const char *fcheck_phase_name(int phase);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
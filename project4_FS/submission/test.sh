@@ -45,3 +45,31 @@ echo 'goodrefcnt'
 ./fcheck ../test_images/goodrefcnt
 echo 'goodrm'
 ./fcheck ../test_images/goodrm
+
+# the cases below make their images with genfs
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"; rm -f repair.img repair.img.undo cache.img cache.db' EXIT
+gcc -O2 -o "$dir/genfs" genfs.c
+
+echo 'repair'
+"$dir/genfs" -i 200 -f 8 --fault mrkused repair.img
+cp repair.img "$dir/before"
+./fcheck --repair repair.img
+./fcheck repair.img && echo 'clean after repair'
+echo 'undo'
+./fcheck --undo repair.img.undo repair.img
+cmp -s repair.img "$dir/before" && echo 'same as before repair'
+./fcheck --undo repair.img.undo repair.img
+
+echo 'cache'
+"$dir/genfs" -i 200 -f 8 cache.img
+./fcheck --cache cache.db cache.img && echo 'clean'
+./fcheck --cache cache.db cache.img && echo 'clean from the cache'
+"$dir/genfs" -i 200 -f 8 --fault badrefcnt cache.img
+./fcheck --cache cache.db cache.img
+
+echo 'diff'
+"$dir/genfs" -i 200 -f 8 "$dir/old"
+"$dir/genfs" -i 200 -f 8 --fault badrefcnt "$dir/new"
+./fcheck --diff "$dir/old" "$dir/new"
+./fcheck --diff "$dir/old" "$dir/old" && echo 'no changes'